@@ -1,7 +1,14 @@
 #pragma once
 #include "GCState.h"
+#include "SlabAllocator.h"
 #include "spooky.h"
 #include <iostream>
+#include <cstddef>
+#include <type_traits>
+#ifndef _WIN32
+#include <string.h>
+#define _strdup strdup
+#endif
 
 //#define ENSURE_THROW(cond, exception)	\
 //	do { int __afx_condVal=!!(cond); assert(__afx_condVal); if (!(__afx_condVal)){exception;} } while (false)
@@ -23,7 +30,7 @@ class CircularDoubleList
     friend void merge_from_to(CircularDoubleList* source, CircularDoubleList* dest);
     friend void GC::merge_collected();
     friend void GC::init_thread(bool);
-    //because every collectable class has to be derived from this, give things obscure names so they don't polute the namespace for user instance variables.
+    //root letters derive from this, give things obscure names so they don't polute the namespace of the letter types.
     CircularDoubleList* circular_double_list_prev;
     CircularDoubleList* circular_double_list_next;
 protected:
@@ -58,6 +65,13 @@ public:
         bool operator !() { return center->sentinel(); }
     };
     virtual void fake_delete() { disconnect(); }
+
+    //every node in the root lists comes out of the allocating thread's slabs and is freed by the collector in batches
+    static void* operator new(size_t s) { return GC::slab_alloc(s); }
+    static void* operator new[](size_t s) { return GC::slab_alloc(s); }
+    static void operator delete(void* p, size_t s) { GC::slab_free(p, s); }
+    static void operator delete[](void* p, size_t s) { GC::slab_free(p, s); }
+
     circular_double_list_iterator iterate() { return circular_double_list_iterator(*this); }
     bool sentinel() const { return circular_double_list_is_sentinel; }
 
@@ -76,7 +90,16 @@ public:
     CircularDoubleList(CircularDoubleList&&) = delete;
     CircularDoubleList() = delete;
 
-    bool empty() { return circular_double_list_next == circular_double_list_prev; }
+    //a list with one node in it also has next == prev, so compare against the sentinel itself
+    bool empty() { return circular_double_list_next == this; }
+
+    CircularDoubleList* circular_double_list_next_node() const { return circular_double_list_next; }
+    //links a straight to b, whatever was between them is dropped from the list without being touched
+    static void circular_double_list_join(CircularDoubleList* a, CircularDoubleList* b)
+    {
+        a->circular_double_list_next = b;
+        b->circular_double_list_prev = a;
+    }
 };
 inline void merge_from_to(CircularDoubleList* source, CircularDoubleList* dest) {
     assert(source->sentinel());
@@ -93,6 +116,8 @@ inline void merge_from_to(CircularDoubleList* source, CircularDoubleList* dest)
 
 template <typename T>
 struct RootPtr;
+template <typename T>
+struct BorrowedPtr;
 
 class Collectable;
 
@@ -123,6 +148,12 @@ public:
 
 
     explicit InstancePtr( T*  v) { double_ptr_store( v); }
+    //a copy sets both halves to the source's current value directly, skipping the barrier and the dirty log like the
+    //other constructors, since a field being constructed has no old value to snapshot.  A raw copy would carry over the
+    //source's snapshot.
+    InstancePtr(const InstancePtr& o) { double_ptr_store(o.get()); }
+    void operator = (const InstancePtr& o) { store(o.get()); }
+    void operator = (std::nullptr_t) { store(nullptr); }
     template<typename Y>
     explicit InstancePtr(const InstancePtr<Y>& o) {
         double_ptr_store(o.get());
@@ -139,6 +170,10 @@ public:
     explicit InstancePtr(const RootPtr<Y>& o);
     template<typename Y>
     void operator = (const RootPtr<Y>& o);
+    template<typename Y>
+    explicit InstancePtr(const BorrowedPtr<Y>& o);
+    template<typename Y>
+    void operator = (const BorrowedPtr<Y>& o);
 };
 
 template< class T, class U >
@@ -166,10 +201,17 @@ InstancePtr<T> reinterpret_pointer_cast(const InstancePtr<U>& v) noexcept
 
 struct RootLetterBase;
 namespace GC {
+    //byte offsets of a type's InstancePtr fields from the start of the object, built at compile time by GC_TRACE_FIELDS
+    struct TraceTable
+    {
+        int count;
+        const uint32_t* offsets;
+    };
+
+    //collectables aren't in lists, their thread's slab heap keeps track of them
     struct ScanLists
     {
-        Collectable* collectables[3];
-        RootLetterBase* roots[3];
+        RootLetterBase* roots[2];
     };
 
     extern ScanLists* ScanListsByThread[MAX_COLLECTED_THREADS];
@@ -181,6 +223,9 @@ struct RootLetterBase : public CircularDoubleList
 {
     bool owned;
     bool was_owned;
+    //dead and waiting in its thread's pool to be reused, the collector leaves it in the list.  Atomic because an
+    //exiting thread's pool clears it after the thread has given up its slot.
+    std::atomic_bool pooled;
 
     virtual GC::SnapPtr* double_ptr() { abort(); return nullptr; }
 #ifndef NDEBUG
@@ -191,10 +236,10 @@ struct RootLetterBase : public CircularDoubleList
         ENSURE(!deleted); 
         if (deleted) std::cout << '.';
     }
-    RootLetterBase(_sentinel_) : CircularDoubleList(_SENTINEL_), owned(true), was_owned(true), deleted(false)
+    RootLetterBase(_sentinel_) : CircularDoubleList(_SENTINEL_), owned(true), was_owned(true), pooled(false), deleted(false)
     {  }
 #else
-    RootLetterBase(_sentinel_) : CircularDoubleList(_SENTINEL_), owned(true), was_owned(true)
+    RootLetterBase(_sentinel_) : CircularDoubleList(_SENTINEL_), owned(true), was_owned(true), pooled(false)
     {  }
 #endif
 
@@ -206,7 +251,7 @@ struct RootLetterBase : public CircularDoubleList
     }
 };
 
-inline RootLetterBase::RootLetterBase():CircularDoubleList(_START_,GC::ScanListsByThread[GC::MyThreadNumber]->roots[GC::ActiveIndex]),owned(true),was_owned(true)
+inline RootLetterBase::RootLetterBase():CircularDoubleList(_START_,GC::ScanListsByThread[GC::MyThreadNumber]->roots[GC::ActiveIndex]),owned(true),was_owned(true),pooled(false)
 #ifndef NDEBUG
 ,deleted(false)
 #endif
@@ -219,43 +264,112 @@ struct RootLetter : public RootLetterBase
     InstancePtr<T> value;
     virtual GC::SnapPtr* double_ptr() { MEM_TEST(); 
     return &value.value; }
-    virtual void mark() { 
-        MEM_TEST();
-        Collectable* c = value.get_collectable();
-        if (c != nullptr) 
-            c->collectable_mark(); }
+    //defined after Collectable
+    virtual void mark();
 
     RootLetter(RootLetter&&) = delete;
 
     RootLetter() {}
     RootLetter(T *v) :value(v){}
+
+    //a dead letter from this thread's pool if there is one, otherwise a new one
+    static RootLetter* make(T* v);
+    //gives up a letter whose RootPtr is going away
+    static void release(RootLetter* l);
 };
 
+namespace GC {
+    const int ROOT_LETTER_POOL_SIZE = 64;
+}
+
+//Dead letters kept by a thread for its next RootPtrs of the same type.  They stay linked in the root lists, so taking
+//one from the pool or putting one back changes only its flags and value.  The collector only reads and removes letters
+//while every mutating thread is COLLECTING, so a thread touches its pool only when it isn't.
+template <typename T>
+struct RootLetterPool
+{
+    RootLetter<T>* letters[GC::ROOT_LETTER_POOL_SIZE];
+    int count = 0;
+
+    static RootLetterPool& mine()
+    {
+        static thread_local RootLetterPool pool;
+        return pool;
+    }
+    static bool usable() { return GC::ThreadState == GC::PhaseEnum::NOT_COLLECTING || GC::ThreadState == GC::PhaseEnum::RESTORING_SNAPSHOT; }
+    //when the thread exits its pooled letters become ordinary dead letters for the collector to remove
+    ~RootLetterPool()
+    {
+        for (int i = 0; i < count; ++i) letters[i]->pooled.store(false, std::memory_order_release);
+    }
+};
+
+template <typename T>
+RootLetter<T>* RootLetter<T>::make(T* v)
+{
+    if (RootLetterPool<T>::usable()) {
+        RootLetterPool<T>& pool = RootLetterPool<T>::mine();
+        if (pool.count > 0) {
+            RootLetter* l = pool.letters[--pool.count];
+            GC::double_ptr_store(&l->value.value, (void*)v);
+            l->pooled.store(false, std::memory_order_relaxed);
+            l->owned = l->was_owned = true;
+            return l;
+        }
+    }
+    RootLetter* l = new RootLetter(v);
+    GC::log_alloc(sizeof(*l));
+    return l;
+}
+
+template <typename T>
+void RootLetter<T>::release(RootLetter* l)
+{
+    if (RootLetterPool<T>::usable()) {
+        RootLetterPool<T>& pool = RootLetterPool<T>::mine();
+        if (pool.count < GC::ROOT_LETTER_POOL_SIZE) {
+            l->owned = l->was_owned = false;
+            l->pooled.store(true, std::memory_order_relaxed);
+            pool.letters[pool.count++] = l;
+            return;
+        }
+    }
+    l->owned = false;
+    if (GC::ThreadState != GC::PhaseEnum::COLLECTING) l->was_owned = false;
+}
+
 template <typename T>
 struct RootPtr
 {
     RootLetter<T>* var;
 
+    //a moved from RootPtr has no letter, storing into it gets a new one
+    void set(T* o)
+    {
+        if (var == nullptr) var = RootLetter<T>::make(o);
+        else var->value.store(o);
+    }
+
     void operator = ( T* const o)
     {
-        var->value.store(o);
+        set(o);
     }
 
     template <typename Y>
     void operator = (const RootPtr<Y>& v)
     {
-        var->value.store(v.var->value.get());
+        set(v.get());
     }
 
     template <typename Y>
     void operator = (const InstancePtr<Y>& v)
     {
-        var->value.store(v.get());
+        set(v.get());
     }
     template <typename Y>
     void operator = (Y* v)
     {
-        var->value.store(v);
+        set(v);
     }   
     //template <typename Y>
   //  void operator = (Y* const v)
@@ -268,46 +382,53 @@ struct RootPtr
     auto operator[](U i) const { return (*get())[i]; }
     T* get() const
     {
-        return var->value.get();
+        return var == nullptr ? nullptr : var->value.get();
     }
 
     T& operator*() const { return *get(); }
 
     T* operator -> () const
     {
-        return var->value.get();
+        return get();
     }
     template <typename Y>
-    RootPtr(Y* const v) :var(new RootLetter<T>(v)) 
+    RootPtr(Y* const v) :var(RootLetter<T>::make(v)) 
     {
-        GC::log_alloc(sizeof(*var));
     }
 
-   // RootPtr(RootPtr<T>&& v) = delete;
+    //takes the letter over, the moved from RootPtr is left empty
+    RootPtr(RootPtr<T>&& v) :var(v.var) { v.var = nullptr; }
+    void operator = (RootPtr<T>&& v) { std::swap(var, v.var); }
+    void operator = (const RootPtr<T>& v) { set(v.get()); }
+
+    template <typename Y>
+    RootPtr(const BorrowedPtr<Y>& v) :var(RootLetter<T>::make(v.get())) {}
+    template <typename Y>
+    void operator = (const BorrowedPtr<Y>& v)
+    {
+        set(v.get());
+    }
 
-    RootPtr(const InstancePtr<T>& v) :var(new RootLetter<T>(v.get())) {
+    RootPtr(const InstancePtr<T>& v) :var(RootLetter<T>::make(v.get())) {
 #ifndef NDEBUG
         v->memtest();
         var->memtest();
 #endif
-        GC::log_alloc(sizeof(*var));
     }
 
-    RootPtr(const RootPtr<T>& v) :var(new RootLetter<T>(v.var->value.get())) {
+    RootPtr(const RootPtr<T>& v) :var(RootLetter<T>::make(v.get())) {
 #ifndef NDEBUG
-        v.var->memtest();
+        if (v.var != nullptr) v.var->memtest();
         var->memtest();
 #endif
-        GC::log_alloc(sizeof(*var));
     }
 
     template <typename Y>
-    RootPtr (const RootPtr<Y>  &v) :var(new RootLetter<T>(v.var->value.get())){
+    RootPtr (const RootPtr<Y>  &v) :var(RootLetter<T>::make(v.get())){
 #ifndef NDEBUG
-        v.var->memtest();
+        if (v.var != nullptr) v.var->memtest();
         var->memtest();
 #endif
-        GC::log_alloc(sizeof(*var));
     }
 //    template <typename Y>
 //    RootPtr (const InstancePtr<Y> &v) :var(new RootLetter<T>(v.get())) {
@@ -316,13 +437,11 @@ struct RootPtr
 //#endif
 //        GC::log_alloc(sizeof(*var));
 //    }
-    RootPtr() :var(new RootLetter<T>)
+    RootPtr() :var(RootLetter<T>::make(nullptr))
     {
-        GC::log_alloc(sizeof(*var));
     }
     ~RootPtr() { 
-        var->owned = false; 
-        if (GC::ThreadState != GC::PhaseEnum::COLLECTING) var->was_owned = false;
+        if (var != nullptr) RootLetter<T>::release(var);
     }
 };
 
@@ -332,7 +451,7 @@ RootPtr<T> static_pointer_cast(const RootPtr<U>& v) noexcept
 #ifndef NDEBUG
     v->memtest();
 #endif
-    return RootPtr<T>(static_cast<T*>(v.var->value.get()));
+    return RootPtr<T>(static_cast<T*>(v.get()));
 }
 
 template< class T, class U >
@@ -341,7 +460,7 @@ RootPtr<T> const_pointer_cast(const RootPtr<U>& v) noexcept
 #ifndef NDEBUG
     v->memtest();
 #endif
-    return RootPtr<T>(const_cast<T*>(v.var->value.get()));
+    return RootPtr<T>(const_cast<T*>(v.get()));
 }
 
 template< class T, class U >
@@ -350,7 +469,7 @@ RootPtr<T> const_dynamic_cast(const RootPtr<U>& v) noexcept
 #ifndef NDEBUG
     v->memtest();
 #endif
-    return RootPtr<T>(dynamic_cast<T*>(v.var->value.get()));
+    return RootPtr<T>(dynamic_cast<T*>(v.get()));
 }
 
 template< class T, class U >
@@ -359,7 +478,55 @@ RootPtr<T> const_reinterpret_cast(const RootPtr<U>& v) noexcept
 #ifndef NDEBUG
     v->memtest();
 #endif
-    return RootPtr<T>(reinterpret_cast<T*>(v.var->value.get()));
+    return RootPtr<T>(reinterpret_cast<T*>(v.get()));
+}
+
+//A pointer handed down to a callee without registering a root of its own.  It is only good for as long as what it was
+//made from, the caller's RootPtr or an InstancePtr in an object the caller can reach, still points at the same object,
+//so it is meant for parameters, not for keeping.
+//Made from a bare pointer, like the result of cnew, or from a temporary RootPtr there is nothing to borrow from, so it
+//holds a root letter of its own until it goes away.  Copies never own a letter, they borrow from the original.
+template <typename T>
+struct BorrowedPtr
+{
+    T* ptr;
+    RootLetter<T>* own;
+
+    T* get() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    T* operator -> () const { return ptr; }
+    template <typename U>
+    auto operator[](U i) const { return (*ptr)[i]; }
+
+    BorrowedPtr(std::nullptr_t) :ptr(nullptr), own(nullptr) {}
+    template <typename Y>
+    BorrowedPtr(Y* const v) :ptr(v), own(v == nullptr ? nullptr : RootLetter<T>::make(v)) {}
+    template <typename Y>
+    BorrowedPtr(const RootPtr<Y>& v) :ptr(v.get()), own(nullptr) {}
+    //takes the temporary's letter over instead of borrowing from something about to go away
+    BorrowedPtr(RootPtr<T>&& v) :ptr(v.get()), own(v.var) { v.var = nullptr; }
+    template <typename Y>
+    BorrowedPtr(const InstancePtr<Y>& v) :ptr(v.get()), own(nullptr) {}
+    BorrowedPtr(const BorrowedPtr& v) :ptr(v.ptr), own(nullptr) {}
+    template <typename Y>
+    BorrowedPtr(const BorrowedPtr<Y>& v) :ptr(v.get()), own(nullptr) {}
+    void operator = (const BorrowedPtr&) = delete;
+    ~BorrowedPtr()
+    {
+        if (own != nullptr) RootLetter<T>::release(own);
+    }
+};
+
+template<typename T>
+template<typename Y>
+InstancePtr<T>::InstancePtr(const BorrowedPtr<Y>& v) {
+    double_ptr_store(v.get());
+}
+
+template<typename T>
+template<typename Y>
+void InstancePtr<T>::operator = (const BorrowedPtr<Y>& v) {
+    store(v.get());
 }
 
 template<typename T>
@@ -368,7 +535,7 @@ InstancePtr<T>::InstancePtr(const RootPtr<Y>& v) {
 #ifndef NDEBUG
     v->memtest();
 #endif
-    double_ptr_store(v.var->value.get());
+    double_ptr_store(v.get());
 }
 
 template<typename T>
@@ -377,15 +544,14 @@ void InstancePtr<T>::operator = (const RootPtr<Y>& v) {
 #ifndef NDEBUG
     v->memtest();
 #endif
-    store(v.var->value.get());
+    store(v.get());
 }
 
 namespace GC {
-    void merge_collected();
-    void _do_collection();
-    void _do_restore_snapshot();
-    void _end_collection_start_restore_snapshot();
-    void _do_finalize_snapshot();
+    //runs the destructor of a dead object for the sweep, which frees the memory itself
+    void destroy_collectable(Collectable* c);
+    //in debug builds marks a dead object as deleted for memtest, just before the sweep frees it
+    void poison_collectable(Collectable* c);
 }
 
 enum class CollectableEqualityClass
@@ -394,42 +560,23 @@ enum class CollectableEqualityClass
     by_string,
 };
 
-#define ONE_COLLECT_THREAD
-
-class Collectable: public CircularDoubleList {
-protected:
-    friend void GC::merge_collected();
-    friend void GC::_do_collection();
-    friend void GC::_do_restore_snapshot();
-    friend void GC::_end_collection_start_restore_snapshot();
-    friend void GC::_do_finalize_snapshot();
-//public:
-//    bool deleted;
+//Collectable has to be the first base of a collectable type, the sweep and the marker find an object's mark byte
+//from the address it was allocated at.  The object itself holds nothing but its vtable pointer, its thread's slab heap
+//keeps track of it and its mark lives in its slab's mark map or in the OutsideHeader in front of it.
+class Collectable {
+    friend void GC::destroy_collectable(Collectable* c);
 protected:
-    //when not tracing contains self index
-    //when tracing points back to where we came from or 0 if that was a root
-    //when in a free list points to the next free element as an unbiased index into this block
-    Collectable* collectable_back_ptr;
-
-    unsigned int collectable_back_ptr_from_counter : 31;//came from nth snapshot ptr
-#ifdef ONE_COLLECT_THREAD
-    bool collectable_marked : 1; //only one collection thread
-#else
-    std::atomic_bool marked;
-#endif
     virtual ~Collectable() 
     {
  
     }
-    Collectable(_sentinel_) : CircularDoubleList(_SENTINEL_), collectable_back_ptr(nullptr) , collectable_marked(false)
-#ifndef NDEBUG
-,deleted(false)
-#endif
-    {
-        
-    }
 
 public:
+    static void* operator new(size_t s) { return GC::collectable_alloc(s); }
+    static void operator delete(void* p) { GC::collectable_free(p); }
+    //an array would be one allocation holding many objects, each of which the sweep would have to find by itself
+    static void* operator new[](size_t s) = delete;
+    static void operator delete[](void* p) = delete;
 
 #ifndef NDEBUG
 
@@ -439,74 +586,68 @@ public:
         ENSURE(deleted == 0);
         if (deleted == 0xfeebfdcb) std::cout << ':';
 }
-    void fake_delete() {
-        if (deleted == 0xfeebfdcb) {
-            std::cout << '$';
-            return;
-        }
-        else if (deleted != 0) {
-            std::cout << 'C';
-            //return;
-        }
-        if (collectable_marked != 0 && collectable_marked != 0xbf) {
-            std::cout << 'c';
-        }
-        deleted = 0xfeebfdcb; disconnect();
-    
-    }
 
 #endif
    
-    //to keep from blowing the stack when marking a long chain, this is coded as a loop instead of being recursive and back pointers and context
-    //is stored in the objects themselves instead of on the stack.
+    //true if this thread is the one that gets to trace the object.
+    //Claimed by exchange when there is more than one mark thread.  The GC_NO_DESTRUCTOR bit of the byte never changes.
+    //The claiming thread counts the object's bytes toward what the pacer sees as live.
+    bool collectable_claim()
+    {
+        std::atomic<uint8_t>* m = GC::collectable_mark_byte(this);
+        uint8_t epoch = GC::MarkEpoch;
+        uint8_t old = m->load(std::memory_order_relaxed);
+        if ((old & GC::MARK_EPOCH_BITS) == epoch) return false;
+        uint8_t to = epoch | (old & GC::MARK_NO_DESTRUCTOR);
+        if (GC::ThreadMarkDeque == nullptr) m->store(to, std::memory_order_relaxed);
+        else if ((m->exchange(to, std::memory_order_relaxed) & GC::MARK_EPOCH_BITS) == epoch) return false;
+        GC::ThreadMarkedBytes += GC::collectable_bytes(this);
+        ++GC::ThreadMarkedObjects;
+        return true;
+    }
     void collectable_mark()
     {
         MEM_TEST();
-        Collectable* n=nullptr;
+        if (collectable_claim()) collectable_trace();
+    }
+    //Traces everything reachable from this claimed object, without writing anything to the objects.  Children are
+    //claimed as they're found and wait on this thread's MarkStack.  Each one popped off goes through a short FIFO
+    //while its header is prefetched, so by the time it's traced it's likely in cache.
+    //Some claimed objects are left in this thread's deque instead, so that idle mark threads can steal them.
+    //Types with a GC_TRACE_FIELDS table are walked through its offsets, others field by field through the virtuals.
+    void collectable_trace()
+    {
+        MEM_TEST();
+        GC::MarkDeque* share = GC::ThreadMarkDeque;
+        GC::MarkStack& stack = GC::ThreadMarkStack;
+        Collectable* fifo[GC::MARK_PREFETCH_DEPTH];
+        int depth = GC::MarkPrefetch ? GC::MARK_PREFETCH_DEPTH : 1;
+        int head = 0;
+        int queued = 0;
         Collectable* c = this;
-        //if (deleted) std::cout << '!';
-        if (collectable_marked) return;
-#ifdef ONE_COLLECT_THREAD
-        collectable_marked = true;
-        {
-#else
-        bool got_it = marked.exchange(true);
-        if (!got_it) {
-#endif
-            int t = total_instance_vars() - 1;
-            for (;;) {
-                if (t >= 0) {
-                    n = c->index_into_instance_vars(t)->get_collectable();
-                    if (n!=nullptr){
+        for (;;) {
+            const GC::TraceTable* fields = c->collectable_trace_table();
+            for (int t = c->collectable_field_count(fields) - 1; t >= 0; --t) {
+                Collectable* n = c->collectable_field(fields, t)->get_collectable();
+                if (n == nullptr) continue;
 #ifndef NDEBUG
-                            if (n->deleted) std::cout << '*';
+                if (n->deleted) std::cout << '*';
 #endif                       
-
-                        if (!n->collectable_marked) {
-#ifdef ONE_COLLECT_THREAD
-                            n->collectable_marked = true;
-                            {
-#else
-                            got_it = marked.exchange(true);
-                            if (!got_it) {
-#endif
-                                n->collectable_back_ptr_from_counter = t;
-                                n->collectable_back_ptr = c;
-                                c = n;
-                                t = c->total_instance_vars() - 1;
-                                continue;
-                            }
-                        }
-                    }
-                    --t;
-                }
-                else {
-                    if (c == this) return;
-                    n = c;
-                    c = c->collectable_back_ptr;
-                    t = n->collectable_back_ptr_from_counter - 1;
+                if (!n->collectable_claim()) continue;
+                if (share != nullptr && share->size() < GC::MARK_SHARE_DEPTH && share->push(n)) {
+                    if (GC::MarkersParked.load(std::memory_order_relaxed)) GC::wake_parked_markers();
                 }
+                else stack.push(n);
+            }
+            Collectable* n;
+            while (queued < depth && stack.pop(n)) {
+                if (depth > 1) GC::prefetch(n);
+                fifo[(head + queued++) & (GC::MARK_PREFETCH_DEPTH - 1)] = n;
             }
+            if (queued == 0) return;
+            c = fifo[head];
+            head = (head + 1) & (GC::MARK_PREFETCH_DEPTH - 1);
+            --queued;
         }
     }
     //virtual int num_ptrs_in_snapshot() = 0;
@@ -515,7 +656,17 @@ public:
     virtual int total_instance_vars() const = 0;
     virtual size_t my_size() const = 0;
     virtual InstancePtrBase* index_into_instance_vars(int num) = 0;
-    virtual void clean_after_collect() {}
+    //null for types whose fields change at run time, like the vectors
+    virtual const GC::TraceTable* collectable_trace_table() const { return nullptr; }
+    int collectable_field_count(const GC::TraceTable* fields) const
+    {
+        return fields != nullptr ? fields->count : total_instance_vars();
+    }
+    InstancePtrBase* collectable_field(const GC::TraceTable* fields, int num)
+    {
+        if (fields != nullptr) return (InstancePtrBase*)((char*)this + fields->offsets[num]);
+        return index_into_instance_vars(num);
+    }
     virtual CollectableEqualityClass equality_class() const { return CollectableEqualityClass::by_address; }
     virtual bool equal(const Collectable *o)
     {
@@ -531,14 +682,113 @@ public:
     }
     Collectable(Collectable&&) = delete;
 
-    Collectable() :CircularDoubleList(_START_, GC::ScanListsByThread[GC::MyThreadNumber]->collectables[GC::ActiveIndex]), collectable_back_ptr(nullptr), collectable_marked(false)
+    Collectable()
 #ifndef NDEBUG
-        ,deleted(false)
+        :deleted(false)
 #endif
     {
         }
 
 };
+
+inline void GC::destroy_collectable(Collectable* c)
+{
+    c->~Collectable();
+}
+
+//the free list link goes where the vtable was, deleted stays poisoned until the cell is allocated again
+#ifndef NDEBUG
+inline void GC::poison_collectable(Collectable* c)
+{
+    c->deleted = (int32_t)0xfeebfdcb;
+}
+#else
+inline void GC::poison_collectable(Collectable*) {}
+#endif
+
+//GC_TRACE_FIELDS(first, second) in the body of a class derived from Collectable writes total_instance_vars,
+//index_into_instance_vars and a table of the fields' offsets, so the marker can walk them without a virtual call per
+//field.  Every field named has to be an InstancePtr, at most 16 of them, and Collectable has to be the first base.
+#define GC_EXPAND(x) x
+#define GC_CAT_(a, b) a##b
+#define GC_CAT(a, b) GC_CAT_(a, b)
+#define GC_COUNT_FIELDS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define GC_COUNT_FIELDS(...) GC_EXPAND(GC_COUNT_FIELDS_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define GC_OFFSETS_1(T, a) (uint32_t)offsetof(T, a)
+#define GC_OFFSETS_2(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_1(T, __VA_ARGS__))
+#define GC_OFFSETS_3(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_2(T, __VA_ARGS__))
+#define GC_OFFSETS_4(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_3(T, __VA_ARGS__))
+#define GC_OFFSETS_5(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_4(T, __VA_ARGS__))
+#define GC_OFFSETS_6(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_5(T, __VA_ARGS__))
+#define GC_OFFSETS_7(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_6(T, __VA_ARGS__))
+#define GC_OFFSETS_8(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_7(T, __VA_ARGS__))
+#define GC_OFFSETS_9(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_8(T, __VA_ARGS__))
+#define GC_OFFSETS_10(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_9(T, __VA_ARGS__))
+#define GC_OFFSETS_11(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_10(T, __VA_ARGS__))
+#define GC_OFFSETS_12(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_11(T, __VA_ARGS__))
+#define GC_OFFSETS_13(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_12(T, __VA_ARGS__))
+#define GC_OFFSETS_14(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_13(T, __VA_ARGS__))
+#define GC_OFFSETS_15(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_14(T, __VA_ARGS__))
+#define GC_OFFSETS_16(T, a, ...) (uint32_t)offsetof(T, a), GC_EXPAND(GC_OFFSETS_15(T, __VA_ARGS__))
+//the classes aren't standard layout, but offsetof works on them as long as there are no virtual bases
+#if defined(_MSC_VER)
+#define GC_OFFSETOF_WARNING_OFF
+#define GC_OFFSETOF_WARNING_ON
+#else
+#define GC_OFFSETOF_WARNING_OFF _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Winvalid-offsetof\"")
+#define GC_OFFSETOF_WARNING_ON _Pragma("GCC diagnostic pop")
+#endif
+
+#define GC_TRACE_FIELDS(...) \
+    const GC::TraceTable* collectable_fields() const \
+    { \
+        typedef std::remove_cv_t<std::remove_pointer_t<decltype(this)> > collectable_self; \
+        GC_OFFSETOF_WARNING_OFF \
+        static constexpr uint32_t offsets[] = { GC_EXPAND(GC_CAT(GC_OFFSETS_, GC_COUNT_FIELDS(__VA_ARGS__))(collectable_self, __VA_ARGS__)) }; \
+        GC_OFFSETOF_WARNING_ON \
+        static constexpr GC::TraceTable table = { (int)(sizeof(offsets) / sizeof(offsets[0])), offsets }; \
+        assert((const void*)static_cast<const Collectable*>(this) == (const void*)this); \
+        return &table; \
+    } \
+    virtual const GC::TraceTable* collectable_trace_table() const { return collectable_fields(); } \
+    virtual int total_instance_vars() const { return collectable_fields()->count; } \
+    virtual InstancePtrBase* index_into_instance_vars(int num) { return (InstancePtrBase*)((char*)this + collectable_fields()->offsets[num]); }
+
+namespace GC {
+    //true for types registered with GC_NO_DESTRUCTOR.  Only the exact type counts, a subclass has to be registered itself.
+    template <typename T>
+    struct NoDestructor : std::false_type {};
+
+    //called by cnew on every new object
+    template <typename T>
+    void note_destructor(T* p)
+    {
+        if (NoDestructor<T>::value) collectable_mark_byte(p)->fetch_or(MARK_NO_DESTRUCTOR, std::memory_order_relaxed);
+    }
+}
+//GC_NO_DESTRUCTOR(T), at global scope after T, promises that T's destructor does nothing that matters, because it only
+//holds things like ints and InstancePtrs.  The flag goes in the object's mark byte, so the sweep hands dead T's back to
+//their slabs from the mark map alone, without reading the objects.
+#define GC_NO_DESTRUCTOR(T) namespace GC { template <> struct NoDestructor<T> : std::true_type {}; }
+
+namespace GC {
+    //true for element types registered with GC_ZERO_INIT
+    template <typename T>
+    struct ZeroInit : std::false_type {};
+}
+//GC_ZERO_INIT(T), at global scope after T, promises that a T with every byte zero is the same as a default constructed
+//one, and that T has nothing to destroy.  A CollectableInlineVector<T> then takes its elements straight from calloc,
+//so making even a big one doesn't touch every element, and the system can hand it pages that are already zero.
+#define GC_ZERO_INIT(T) namespace GC { template <> struct ZeroInit<T> : std::true_type {}; }
+
+template <typename T>
+void RootLetter<T>::mark() {
+    MEM_TEST();
+    Collectable* c = value.get_collectable();
+    if (c != nullptr)
+        c->collectable_mark();
+}
+
 struct CollectableString : public Collectable
 {
     char* str;
@@ -547,7 +797,6 @@ struct CollectableString : public Collectable
     virtual int total_instance_vars() const { return 0; }
     virtual size_t my_size() const { return sizeof(*this); }
     virtual InstancePtrBase* index_into_instance_vars(int num) { return nullptr; }
-    virtual void clean_after_collect() {}
     virtual CollectableEqualityClass equality_class() const { return CollectableEqualityClass::by_string; }
     virtual bool equal(const Collectable* o)
     {
@@ -579,7 +828,7 @@ struct CollectableBlock : public Collectable
 
 
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
-    bool push_back(const RootPtr<T>& o) {
+    bool push_back(BorrowedPtr<T> o) {
         if (size == 32) return false;
         block[size++] = o;
         if (size >= reserved) reserved = size;
@@ -634,7 +883,7 @@ struct Collectable2Block : public Collectable
     int total_instance_vars() { return b_reserved; }
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
     Collectable2Block() :size(0), b_reserved(0) {}
-    bool push_back(const RootPtr<T>& o) {
+    bool push_back(BorrowedPtr<T> o) {
         if (size == 32*32) return false;
         ++size;
         if (b_size() > b_size(-1)) {
@@ -716,7 +965,7 @@ struct Collectable3Block : public Collectable
     int total_instance_vars() { return b_reserved; }
     Collectable3Block() :size(0), b_reserved(0) {}
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
-    bool push_back(const RootPtr<T>& o) {
+    bool push_back(BorrowedPtr<T> o) {
         if (size == 32 * 32 * 32) return false;
         ++size;
         if (b_size() > b_size(-1)) {
@@ -797,7 +1046,7 @@ struct Collectable4Block : public Collectable
     int total_instance_vars() { return b_reserved; }
     Collectable4Block() :size(0), b_reserved(0) {}
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
-    bool push_back(const RootPtr<T>& o) {
+    bool push_back(BorrowedPtr<T> o) {
         if (size == 32 * 32 * 32) return false;
         ++size;
         if (b_size() > b_size(-1)) {
@@ -842,7 +1091,7 @@ struct Collectable4Block : public Collectable
         return block[j]->insure(i-(j<<15));
     }
 
-    bool push_front(const RootPtr<T>& o) {
+    bool push_front(BorrowedPtr<T> o) {
         if (size == 32 * 32 * 32 * 32) return false;
         if (size > 0) {
             insure(size) = (*this)[size - 1];
@@ -887,8 +1136,7 @@ template<typename T>
 struct CollectableInlineVector : public Collectable
 {
     T* data;
-    InstancePtrBase * * instance_counts;
-    int total_vars;
+    int per_element;
     int size;
     /*
     void resize(int s) {
@@ -917,38 +1165,29 @@ struct CollectableInlineVector : public Collectable
         return &data[i];
     }
 
-    CollectableInlineVector(int s) : instance_counts(nullptr),size(s){
-        data = new T [s];
-        
-        total_vars = 0;
-        for (int i = 0; i < s; ++i) {
-            total_vars += data[i].total_instance_vars();
-        }
-        instance_counts = new InstancePtrBase * [total_vars];
-        int t = 0;
-        for (int i = 0; i < s; ++i) {
-            for (int j = data[i].total_instance_vars() - 1; j >= 0; --j) {
-                instance_counts[t++] = data[i].index_into_instance_vars(j);
-            }
-        }
-
+    //every element has the same number of InstancePtrs, so the collector finds one by arithmetic
+    CollectableInlineVector(int s) : size(s){
+        static_assert(!GC::ZeroInit<T>::value || std::is_trivially_destructible<T>::value, "GC_ZERO_INIT types can't have destructors");
+        if (GC::ZeroInit<T>::value) data = (T*)calloc(s > 0 ? s : 1, sizeof(T));
+        else data = new T [s];
+        per_element = s > 0 ? data[0].total_instance_vars() : 0;
     }
     int total_instance_vars() const
     {
-        return total_vars;
+        return size * per_element;
     }
     size_t my_size() const 
     {
-        return sizeof(*this)+size*sizeof(T)+ total_vars*sizeof(void *);
+        return sizeof(*this)+size*sizeof(T);
     }
     InstancePtrBase* index_into_instance_vars(int num)
     {
-        return instance_counts[num];
+        return data[num / per_element].index_into_instance_vars(per_element - 1 - num % per_element);
     }
     ~CollectableInlineVector()
     {
-        delete [] data;
-        delete[] instance_counts;
+        if (GC::ZeroInit<T>::value) free(data);
+        else delete [] data;
     }
 };
 /*
@@ -999,7 +1238,7 @@ struct CollectableVectoreUse : public Collectable
     int scan_size;
     int reserved;
 
-    std::unique_ptr<InstancePtr<T> > data;
+    std::unique_ptr<InstancePtr<T>[] > data;
 
     CollectableVectoreUse(int s) :size(0), scan_size(0),reserved(s), data( new InstancePtr<T>[s]) {}
     int total_instance_vars() const {
@@ -1013,7 +1252,7 @@ struct CollectableVectoreUse : public Collectable
     size_t my_size() const { return sizeof(*this) + sizeof(InstancePtr<T>) * reserved; }
 
 
-    bool push_back(const RootPtr<T>& o) {
+    bool push_back(BorrowedPtr<T> o) {
         MEM_TEST();
         if (size >= reserved) return false;
         (data.get())[size++] = o;
@@ -1049,7 +1288,7 @@ struct CollectableVectoreUse : public Collectable
         for (int i = 0; i < size; ++i) (data.get())[i] = (T*)nullptr;
         size = 0;
     }
-    bool resize(int s, const RootPtr<T>& exemplar)
+    bool resize(int s, BorrowedPtr<T> exemplar)
     {
         MEM_TEST();
         if (s > reserved) return false;
@@ -1076,7 +1315,7 @@ struct CollectableVectoreUse : public Collectable
         if (size > scan_size) scan_size = size;
         return true;
     }
-    bool push_front(const RootPtr<T>& o)
+    bool push_front(BorrowedPtr<T> o)
     {
         MEM_TEST();
         if (size >= reserved) return false;
@@ -1162,40 +1401,40 @@ class CollectableVector : public Collectable
         const InstancePtr<T>* operator->() { return &v[pos]; }
 
         bool operator == (CollectableVector<T>::iterator i) {
-            return pos == i.pos && v.data.get() == i.pos.data.get();
+            return pos == i.pos && v.get() == i.v.get();
         }
         bool operator < (CollectableVector<T>::iterator i) {
-            return pos < i.pos&& v.data.get() == i.pos.data.get();
+            return pos < i.pos&& v.get() == i.v.get();
         }
         bool operator > (CollectableVector<T>::iterator i) {
-            return pos > i.pos && v.data.get() == i.pos.data.get();
+            return pos > i.pos && v.get() == i.v.get();
         }
         bool operator >= (CollectableVector<T>::iterator i) {
-            return pos >= i.pos && v.data.get() == i.pos.data.get();
+            return pos >= i.pos && v.get() == i.v.get();
         }
         bool operator <= (CollectableVector<T>::iterator i) {
-            return pos <= i.pos && v.data.get() == i.pos.data.get();
+            return pos <= i.pos && v.get() == i.v.get();
         }
         bool operator != (CollectableVector<T>::iterator i) {
-            return pos != i.pos && v.data.get() == i.pos.data.get();
+            return !(*this == i);
         }
         bool operator == (CollectableVector<T>::const_iterator i) {
-            return pos == i.pos && v.data.get() == i.pos.data.get();
+            return pos == i.pos && v.get() == i.v.get();
         }
         bool operator < (CollectableVector<T>::const_iterator i) {
-            return pos < i.pos&& v.data.get() == i.pos.data.get();
+            return pos < i.pos&& v.get() == i.v.get();
         }
         bool operator > (CollectableVector<T>::const_iterator i) {
-            return pos > i.pos && v.data.get() == i.pos.data.get();
+            return pos > i.pos && v.get() == i.v.get();
         }
         bool operator >= (CollectableVector<T>::const_iterator i) {
-            return pos >= i.pos && v.data.get() == i.pos.data.get();
+            return pos >= i.pos && v.get() == i.v.get();
         }
         bool operator <= (CollectableVector<T>::const_iterator i) {
-            return pos <= i.pos && v.data.get() == i.pos.data.get();
+            return pos <= i.pos && v.get() == i.v.get();
         }
         bool operator != (CollectableVector<T>::const_iterator i) {
-            return pos != i.pos && v.data.get() == i.pos.data.get();
+            return !(*this == i);
         }
     };
     struct iterator{
@@ -1240,40 +1479,40 @@ class CollectableVector : public Collectable
         InstancePtr<T>* operator->() { return &v[pos]; }
 
         bool operator == (CollectableVector<T>::iterator i) {
-            return pos == i.pos && v.data.get() == i.pos.data.get();
+            return pos == i.pos && v.get() == i.v.get();
         }
         bool operator < (CollectableVector<T>::iterator i) {
-            return pos < i.pos && v.data.get() == i.pos.data.get();
+            return pos < i.pos && v.get() == i.v.get();
         }
         bool operator > (CollectableVector<T>::iterator i) {
-            return pos > i.pos && v.data.get() == i.pos.data.get();
+            return pos > i.pos && v.get() == i.v.get();
         }
         bool operator >= (CollectableVector<T>::iterator i) {
-            return pos >= i.pos && v.data.get() == i.pos.data.get();
+            return pos >= i.pos && v.get() == i.v.get();
         }
         bool operator <= (CollectableVector<T>::iterator i) {
-            return pos <= i.pos && v.data.get() == i.pos.data.get();
+            return pos <= i.pos && v.get() == i.v.get();
         }
         bool operator != (CollectableVector<T>::iterator i) {
-            return pos != i.pos && v.data.get() == i.pos.data.get();
+            return !(*this == i);
         }
         bool operator == (CollectableVector<T>::const_iterator i) {
-            return pos == i.pos && v.data.get() == i.pos.data.get();
+            return pos == i.pos && v.get() == i.v.get();
         }
         bool operator < (CollectableVector<T>::const_iterator i) {
-            return pos < i.pos&& v.data.get() == i.pos.data.get();
+            return pos < i.pos&& v.get() == i.v.get();
         }
         bool operator > (CollectableVector<T>::const_iterator i) {
-            return pos > i.pos && v.data.get() == i.pos.data.get();
+            return pos > i.pos && v.get() == i.v.get();
         }
         bool operator >= (CollectableVector<T>::const_iterator i) {
-            return pos >= i.pos && v.data.get() == i.pos.data.get();
+            return pos >= i.pos && v.get() == i.v.get();
         }
         bool operator <= (CollectableVector<T>::const_iterator i) {
-            return pos <= i.pos && v.data.get() == i.pos.data.get();
+            return pos <= i.pos && v.get() == i.v.get();
         }
         bool operator != (CollectableVector<T>::const_iterator i) {
-            return pos != i.pos && v.data.get() == i.pos.data.get();
+            return !(*this == i);
         }
     };
     iterator begin() {
@@ -1303,7 +1542,7 @@ class CollectableVector : public Collectable
 
     bool empty() const { return size() == 0; }
 
-    void assign(const RootPtr<CollectableVector<T> > &o)
+    void assign(BorrowedPtr<CollectableVector<T> > o)
     {
         MEM_TEST();
         if (this == o.get()) return;
@@ -1322,9 +1561,9 @@ class CollectableVector : public Collectable
 
     CollectableVector() : data(cnew (CollectableVectoreUse<T>(8))){}
     CollectableVector(int s) : data(cnew (CollectableVectoreUse<T>(s<<1))){}
-    CollectableVector(int s, const RootPtr<T>& exemplar) : data(cnew( CollectableVectoreUse<T>(s << 1))){ resize(s, exemplar); }
+    CollectableVector(int s, BorrowedPtr<T> exemplar) : data(cnew( CollectableVectoreUse<T>(s << 1))){ resize(s, exemplar); }
     CollectableVector(int s, InstancePtr<T>& exemplar) : data(cnew (CollectableVectoreUse<T>(s << 1))) { resize(s, exemplar); }
-    void push_back(const RootPtr<T>& o)
+    void push_back(BorrowedPtr<T> o)
     {
         MEM_TEST();
         if (!data->push_back(o)) {
@@ -1410,7 +1649,7 @@ class CollectableVector : public Collectable
         return iterator(*this, f.pos + 1);
     }
 
-    iterator insert(const_iterator f, const RootPtr<T>& a)
+    iterator insert(const_iterator f, BorrowedPtr<T> a)
     {
         MEM_TEST();
         int p = f.pos;
@@ -1426,7 +1665,7 @@ class CollectableVector : public Collectable
         return iterator(this, p);
     }
 
-    iterator insert(const_iterator f, int n, const RootPtr<T>& a)
+    iterator insert(const_iterator f, int n, BorrowedPtr<T> a)
     {
         MEM_TEST();
         int p = f.pos;
@@ -1440,7 +1679,7 @@ class CollectableVector : public Collectable
         data->size+=n;
         return iterator(this, p+n);
     }
-    iterator insert(const_iterator f, const_iterator t, const RootPtr<T>& a)
+    iterator insert(const_iterator f, const_iterator t, BorrowedPtr<T> a)
     {
         MEM_TEST();
         int n = t.pos - f.pos;
@@ -1467,7 +1706,7 @@ class CollectableVector : public Collectable
         data = o.data;
         o.data = t;
     }
-    void resize(int s, const RootPtr<T>& exemplar)
+    void resize(int s, BorrowedPtr<T> exemplar)
     {
         MEM_TEST();
         if (!data->resize(s, exemplar)) {
@@ -1539,7 +1778,7 @@ class CollectableVector : public Collectable
 
         }
     }
-    void push_front(const RootPtr<T>& o) {
+    void push_front(BorrowedPtr<T> o) {
         MEM_TEST();
         int s = size()+1;
  //       reserve(s);
@@ -1598,7 +1837,7 @@ public:
 
 
     SharableVector() :blocks(cnew( Collectable4Block<T>)) {}
-    bool push_back(const RootPtr<T>& o) 
+    bool push_back(BorrowedPtr<T> o) 
     {
         return blocks->push_back(o);
     }
@@ -1610,7 +1849,7 @@ public:
     {
         return blocks->pop_back(o);
     }
-    bool push_front(const RootPtr<T>& o)
+    bool push_front(BorrowedPtr<T> o)
     {
         return blocks->push_front(o);
     }
@@ -1641,15 +1880,3 @@ public:
     }
 
 };
-
-class CollectableSentinel : public Collectable
-{
-public:
-    CollectableSentinel() :Collectable(_SENTINEL_) {
-        circular_double_list_is_sentinel = false;
-    }
-    virtual int total_instance_vars() const { return 0; }
-    //not snapshot, includes ones that could be null because they're live
-    virtual size_t my_size() const { return 0; }
-    virtual InstancePtrBase* index_into_instance_vars(int num) { return nullptr; }
-};
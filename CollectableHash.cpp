@@ -1,4 +1 @@
 #include "CollectableHash.h"
-
-
-CollectableSentinel CollectableNull;
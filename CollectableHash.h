@@ -1,6 +1,10 @@
 #pragma once
 #include "Collectable.h"
 #include "spooky.h"
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
 
 
 /* A simple hash table with the following assumptions:
@@ -9,410 +13,663 @@
 2) the value type should be a collectable or at least something that has the total_instance_vars() and index_into_instance_vars(int) methods.  They will all be stored in a single block and the whole thing collected at once.
 3) The table length has to be a power of 2 and will grow as necessary to mostly avoid collisions
 
-The hash table uses linear probing and stays at least 4 times as big as the number of elements.  You can delete from this hash table, it handles that by marking elements "deleted" and not moving anything.
+The key and value tables use linear probing and stay at least 4 times as big as the number of elements.  You can delete from these hash tables, they handle that by marking elements "deleted" and not moving anything.
+CollectableHashTable is probed a group of 16 slots at a time through a byte per slot, with SSE2 where there is
+some, and fills up to 7/8 of its slots before it grows.
+All three move their entries to a bigger array a few at a time rather than all at once, see HASH_MIGRATE_STEP.
 
  */
 
 #define INITIAL_HASH_SIZE 1024
 
-extern CollectableSentinel CollectableNull;
 
+//When a table outgrows its array it starts a new one and keeps the old one in old_data until every entry has moved
+//across.  Each insert, insert_or_assign and erase moves the next HASH_MIGRATE_STEP slots of the old array, lookups
+//look in both, so no one operation pays for copying the whole table.  Once every old entry is counted in, a new
+//array has room for at least 1/16 of the old size more before it has to resize again, and an operation uses up at
+//most one of that besides what it moves, so the move is always over before another resize comes due.
+//New arrays are zeroed memory from calloc (see GC_ZERO_INIT), so starting a resize doesn't touch their entries.
+//What's still proportional to the size is setting the Swiss table's control bytes, one byte a slot, and
+//constructing the linear tables' entries when their plain key or value isn't a number or pointer.  For those the
+//worst case insert is still O(n).
+const int HASH_MIGRATE_STEP = 16;
 
 template<typename K, typename V>
 struct CollectableKeyHashEntry
 {
 	bool skip;
-	bool empty;
+	bool full;
 	InstancePtr<K> key;
 	V value;
-	CollectableKeyHashEntry() :skip(false), empty(true), key(nullptr) {}
+	CollectableKeyHashEntry() :skip(false), full(false), key(nullptr) {}
 	int total_instance_vars() const { return 1; }
-	InstancePtrBase* index_into_instance_vars(int num) { return &key;  }
+	InstancePtrBase* index_into_instance_vars(int) { return &key;  }
 };
 
+//zero bytes are an empty entry, as long as the value is a plain number or pointer
+namespace GC {
+	template<typename K, typename V>
+	struct ZeroInit<CollectableKeyHashEntry<K, V> > : std::integral_constant<bool, std::is_arithmetic<V>::value || std::is_pointer<V>::value> {};
+}
+
 template<typename K, typename V>
 struct CollectableKeyHashTable :public Collectable
 {
+	typedef CollectableKeyHashEntry<K, V> Entry;
+	typedef CollectableInlineVector<Entry> Entries;
 	int HASH_SIZE;
+	//entries in both arrays
 	int used;
-	mutable int wasted;
-	InstancePtr<CollectableInlineVector<struct CollectableKeyHashTable<K, V>>> data;
+	//erased entries in data
+	int wasted;
+	InstancePtr<Entries> data;
+	//while resizing, the old array and how far through it the move has got
+	int OLD_HASH_SIZE;
+	int migrated;
+	InstancePtr<Entries> old_data;
 
 
-	CollectableKeyHashTable(int s = INITIAL_HASH_SIZE) :HASH_SIZE(s), used(0), wasted(0), data(cnew2template(CollectableInlineVector<CollectableKeyHashTable<K, V>>(s))) {}
+	CollectableKeyHashTable(int s = INITIAL_HASH_SIZE) :HASH_SIZE(s), used(0), wasted(0), data(cnew(Entries(s))), OLD_HASH_SIZE(0), migrated(0) {}
 
 	void inc_used()
 	{
 		++used;
-		if (((used + wasted) << 2) > HASH_SIZE)
-		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			RootPtr<CollectableInlineVector<CollectableKeyHashTable<K, V> > > t = data;
-			data = cnew2template(CollectableInlineVector<CollectableKeyHashTable<K, V> >(HASH_SIZE));
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i]->key.empty && !t[i]->skip) insert_or_assign(t[i]->key, t[i]->value);
-			}
+		if (((used + wasted) << 2) > HASH_SIZE) start_resize();
+	}
+	void start_resize()
+	{
+		assert(old_data.get() == nullptr);
+		OLD_HASH_SIZE = HASH_SIZE;
+		//when it's mostly erased entries, rehashing at the same size is enough to clear them out
+		if ((used << 3) > HASH_SIZE) HASH_SIZE <<= 1;
+		old_data = data;
+		data = cnew(Entries(HASH_SIZE));
+		wasted = 0;
+		migrated = 0;
+	}
+	//moved slots are left as erased, so probes in the old array still get past them
+	void migrate_some()
+	{
+		if (old_data.get() == nullptr) return;
+		int end = migrated + HASH_MIGRATE_STEP < OLD_HASH_SIZE ? migrated + HASH_MIGRATE_STEP : OLD_HASH_SIZE;
+		for (; migrated < end; ++migrated) {
+			Entry* e = old_data[migrated];
+			if (!e->full || e->skip) continue;
+			Entry* to = nullptr;
+			probe(data.get(), HASH_SIZE, to, e->key, e->key->hash());
+			claim(to);
+			to->key = e->key;
+			to->value = e->value;
+			e->skip = true;
+			e->key = nullptr;
 		}
+		if (migrated == OLD_HASH_SIZE) old_data = nullptr;
 	}
-	bool findu(CollectableKeyHashEntry<K, V>*& pair, const RootPtr<K>& key, bool for_insert) const
+	//Finds key in one array.  If it isn't there pair is where it would go, the first erased or empty slot on its way.
+	bool probe(Entries* d, int size, Entry*& pair, BorrowedPtr<K> key, uint64_t h) const
 	{
-		uint64_t h = key->hash();
-		int start = h & (HASH_SIZE - 1);
+		int start = h & (size - 1);
 		int i = start;
-		CollectableKeyHashEntry<K, V>* recover = nullptr;
-		GC::safe_point();
+		Entry* recover = nullptr;
 		do {
-			CollectableKeyHashEntry<K, V>* e = data[i];
-			if (e->empty) {
-				if (recover != nullptr) {
-					pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else pair = e;
+			Entry* e = (*d)[i];
+			if (!e->full) {
+				pair = recover != nullptr ? recover : e;
 				return false;
 			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
+			if (e->skip) {
+				if (recover == nullptr) recover = e;
 			}
-			if (!skip && h == e->key->hash() && e->key->equal(key.get())) {
+			else if (h == e->key->hash() && e->key->equal(key.get())) {
 				pair = e;
 				return true;
 			}
-
-			i = (i + 1) & (HASH_SIZE - 1);
+			i = (i + 1) & (size - 1);
 		} while (i != start);
+		pair = recover;
+		return false;
+	}
+	//If key isn't in the table, pair is the slot in data for it.  in_old says which array it was found in.
+	bool findu(Entry*& pair, BorrowedPtr<K> key, bool* in_old = nullptr) const
+	{
+		uint64_t h = key->hash();
+		GC::safe_point();
+		if (in_old != nullptr) *in_old = false;
+		if (probe(data.get(), HASH_SIZE, pair, key, h)) return true;
+		Entry* free = pair;
+		if (old_data.get() != nullptr && probe(old_data.get(), OLD_HASH_SIZE, pair, key, h)) {
+			if (in_old != nullptr) *in_old = true;
+			return true;
+		}
+		pair = free;
 		return false;
 	}
+	//a new entry goes into the slot findu gave back
+	void claim(Entry* pair)
+	{
+		if (pair->skip) {
+			pair->skip = false;
+			--wasted;
+		}
+		pair->full = true;
+	}
 
-	bool contains(const RootPtr<K>& key) const {
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		return findu(pair, key, false);
+	bool contains(BorrowedPtr<K> key) const {
+		Entry* pair = nullptr;
+		return findu(pair, key);
 	}
-	V operator[](const RootPtr<K>& key)
+	V operator[](BorrowedPtr<K> key)
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		if (findu(pair, key, false)) {
+		Entry* pair = nullptr;
+		if (findu(pair, key)) {
 
 			return pair->value;
 		}
 		return V();
 	}
-	bool insert(const RootPtr<K>& key, const V& value)
+	bool insert(BorrowedPtr<K> key, const V& value)
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		if (!findu(pair, key, true)) {
-			pair->key = key;
-			pair->value = value;
-			pair->empty = false;
-			inc_used();
-			return true;
-		}
-		return false;
+		migrate_some();
+		Entry* pair = nullptr;
+		if (findu(pair, key)) return false;
+		claim(pair);
+		pair->key = key;
+		pair->value = value;
+		inc_used();
+		return true;
 	}
-	void insert_or_assign(const RootPtr<K>& key, const V& value)
+	//an entry that hasn't moved yet is changed where it is
+	void insert_or_assign(BorrowedPtr<K> key, const V& value)
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		findu(pair, key, true);
-		bool replacing = !pair->empty;
+		migrate_some();
+		Entry* pair = nullptr;
+		if (findu(pair, key)) {
+			pair->value = value;
+			return;
+		}
+		claim(pair);
 		pair->key = key;
 		pair->value = value;
-		pair->empty = false;
-		if (!replacing) inc_used();
+		inc_used();
 	}
-	bool erase(const RootPtr<K>& key)
+	bool erase(BorrowedPtr<K> key)
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		if (findu(pair, key, false)) {
-			pair->skip = true;
-			pair->key = nullptr;
-			pair->empty = true;
-			used = used - 1;
-			++wasted;
-			return true;
-		}
-		return false;
+		migrate_some();
+		Entry* pair = nullptr;
+		bool in_old;
+		if (!findu(pair, key, &in_old)) return false;
+		pair->skip = true;
+		pair->key = nullptr;
+		pair->value = V();
+		used = used - 1;
+		if (!in_old) ++wasted;
+		return true;
 	}
 	int size() const { return used; }
 
 	virtual int total_instance_vars() const {
-		return 1;
+		return 2;
 	}
 	virtual size_t my_size() const { return sizeof(*this); }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return num == 0 ? &data : &old_data; }
 };
 
 template<typename K, typename V>
 struct CollectableValueHashEntry
 {
 	bool skip;
-	bool empty;
+	bool full;
 	K key;
 	InstancePtr<V> value;
-	CollectableValueHashEntry() :skip(false),empty(true), value(nullptr) {}
+	CollectableValueHashEntry() :skip(false),full(false), value(nullptr) {}
 	int total_instance_vars() const { return 1; }
-	InstancePtrBase* index_into_instance_vars(int num) { return &value; }
+	InstancePtrBase* index_into_instance_vars(int) { return &value; }
 };
 
+//zero bytes are an empty entry, as long as the key is a plain number or pointer
+namespace GC {
+	template<typename K, typename V>
+	struct ZeroInit<CollectableValueHashEntry<K, V> > : std::integral_constant<bool, std::is_arithmetic<K>::value || std::is_pointer<K>::value> {};
+}
+
 template<typename K, typename V>
 struct CollectableValueHashTable :public Collectable
 {
+	typedef CollectableValueHashEntry<K, V> Entry;
+	typedef CollectableInlineVector<Entry> Entries;
 	int HASH_SIZE;
+	//entries in both arrays
 	int used;
-	mutable int wasted;
-	InstancePtr<CollectableInlineVector<CollectableValueHashEntry<K, V>>> data;
+	//erased entries in data
+	int wasted;
+	InstancePtr<Entries> data;
+	//while resizing, the old array and how far through it the move has got
+	int OLD_HASH_SIZE;
+	int migrated;
+	InstancePtr<Entries> old_data;
 
 
-	CollectableValueHashTable(int s = INITIAL_HASH_SIZE) :HASH_SIZE(s), used(0), wasted(0), data(cnew2template(CollectableInlineVector<CollectableValueHashEntry<K, V>>(s))) {}
+	CollectableValueHashTable(int s = INITIAL_HASH_SIZE) :HASH_SIZE(s), used(0), wasted(0), data(cnew(Entries(s))), OLD_HASH_SIZE(0), migrated(0) {}
 
 	void inc_used()
 	{
 		++used;
-		if (((used + wasted) << 2) > HASH_SIZE)
-		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			RootPtr<CollectableInlineVector<CollectableValueHashEntry<K, V> > > t = data;
-			data = cnew2template(CollectableInlineVector<CollectableValueHashEntry<K, V> >(HASH_SIZE));
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i]->empty && !t[i]->skip) insert_or_assign(t[i]->key, t[i]->value);
-			}
+		if (((used + wasted) << 2) > HASH_SIZE) start_resize();
+	}
+	void start_resize()
+	{
+		assert(old_data.get() == nullptr);
+		OLD_HASH_SIZE = HASH_SIZE;
+		//when it's mostly erased entries, rehashing at the same size is enough to clear them out
+		if ((used << 3) > HASH_SIZE) HASH_SIZE <<= 1;
+		old_data = data;
+		data = cnew(Entries(HASH_SIZE));
+		wasted = 0;
+		migrated = 0;
+	}
+	//moved slots are left as erased, so probes in the old array still get past them
+	void migrate_some()
+	{
+		if (old_data.get() == nullptr) return;
+		int end = migrated + HASH_MIGRATE_STEP < OLD_HASH_SIZE ? migrated + HASH_MIGRATE_STEP : OLD_HASH_SIZE;
+		for (; migrated < end; ++migrated) {
+			Entry* e = old_data[migrated];
+			if (!e->full || e->skip) continue;
+			Entry* to = nullptr;
+			probe(data.get(), HASH_SIZE, to, e->key, std::hash<K>()(e->key));
+			claim(to);
+			to->key = e->key;
+			to->value = e->value;
+			e->skip = true;
+			e->key = K();
+			e->value = nullptr;
 		}
+		if (migrated == OLD_HASH_SIZE) old_data = nullptr;
 	}
-	bool findu(CollectableValueHashEntry<K, V>*& pair, const K& key, bool for_insert) const
+	//Finds key in one array.  If it isn't there pair is where it would go, the first erased or empty slot on its way.
+	bool probe(Entries* d, int size, Entry*& pair, const K& key, uint64_t h) const
 	{
-		uint64_t h = std::hash<K>(key);
-		int start = h & (HASH_SIZE - 1);
+		int start = h & (size - 1);
 		int i = start;
-		CollectableValueHashEntry<K, V>* recover = nullptr;
-		GC::safe_point();
+		Entry* recover = nullptr;
 		do {
-			CollectableValueHashEntry<K, V>* e = data[i];
-			if (e->empty) {
-				if (recover != nullptr) {
-					pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else pair = e;
+			Entry* e = (*d)[i];
+			if (!e->full) {
+				pair = recover != nullptr ? recover : e;
 				return false;
 			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
+			if (e->skip) {
+				if (recover == nullptr) recover = e;
 			}
-			if (!skip && h == std::hash<K>(e->key) && e->key == key) {
+			else if (h == std::hash<K>()(e->key) && e->key == key) {
 				pair = e;
 				return true;
 			}
-
-			i = (i + 1) & (HASH_SIZE - 1);
+			i = (i + 1) & (size - 1);
 		} while (i != start);
+		pair = recover;
 		return false;
 	}
+	//If key isn't in the table, pair is the slot in data for it.  in_old says which array it was found in.
+	bool findu(Entry*& pair, const K& key, bool* in_old = nullptr) const
+	{
+		uint64_t h = std::hash<K>()(key);
+		GC::safe_point();
+		if (in_old != nullptr) *in_old = false;
+		if (probe(data.get(), HASH_SIZE, pair, key, h)) return true;
+		Entry* free = pair;
+		if (old_data.get() != nullptr && probe(old_data.get(), OLD_HASH_SIZE, pair, key, h)) {
+			if (in_old != nullptr) *in_old = true;
+			return true;
+		}
+		pair = free;
+		return false;
+	}
+	//a new entry goes into the slot findu gave back
+	void claim(Entry* pair)
+	{
+		if (pair->skip) {
+			pair->skip = false;
+			--wasted;
+		}
+		pair->full = true;
+	}
 
 	bool contains(const K& key) const {
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		return findu(pair, key, false);
+		Entry* pair = nullptr;
+		return findu(pair, key);
 	}
 	RootPtr<V> operator[](const K& key)
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		if (findu(pair, key, false)) {
+		Entry* pair = nullptr;
+		if (findu(pair, key)) {
 
 			return pair->value;
 		}
 		return (V*)nullptr;
 	}
-	bool insert(const K& key, const RootPtr<V>& value)
+	bool insert(const K& key, BorrowedPtr<V> value)
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		if (!findu(pair, key, true)) {
-			pair->key = key;
-			pair->value = value;
-			pair->empty = false;
-			inc_used();
-			return true;
-		}
-		return false;
+		migrate_some();
+		Entry* pair = nullptr;
+		if (findu(pair, key)) return false;
+		claim(pair);
+		pair->key = key;
+		pair->value = value;
+		inc_used();
+		return true;
 	}
-	void insert_or_assign(const K& key, const RootPtr<V>& value)
+	//an entry that hasn't moved yet is changed where it is
+	void insert_or_assign(const K& key, BorrowedPtr<V> value)
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		findu(pair, key, true);
-		bool replacing = !pair->empty;
+		migrate_some();
+		Entry* pair = nullptr;
+		if (findu(pair, key)) {
+			pair->value = value;
+			return;
+		}
+		claim(pair);
 		pair->key = key;
 		pair->value = value;
-		pair->empty = false;
-		if (!replacing) inc_used();
+		inc_used();
 	}
 	bool erase(const K& key)
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		if (findu(pair, key, false)) {
-			pair->skip = true;
-			pair->value = nullptr;
-			pair->empty = true;
-			used = used - 1;
-			++wasted;
-			return true;
-		}
-		return false;
+		migrate_some();
+		Entry* pair = nullptr;
+		bool in_old;
+		if (!findu(pair, key, &in_old)) return false;
+		pair->skip = true;
+		pair->key = K();
+		pair->value = nullptr;
+		used = used - 1;
+		if (!in_old) ++wasted;
+		return true;
 	}
 	int size() const { return used; }
 
 	virtual int total_instance_vars() const {
-		return 1;
+		return 2;
 	}
 	virtual size_t my_size() const { return sizeof(*this); }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return num == 0 ? &data : &old_data; }
 };
 
 
 
+//CollectableHashTable is a Swiss table.  Each slot has a control byte, kept in a plain array beside the entries:
+//the low 7 bits of the key's hash when the slot is full, or EMPTY or DELETED, which have the high bit set.
+//A lookup compares the control bytes of a whole aligned group of HASH_GROUP slots against the hash at once, and
+//only looks at the entries whose byte matches.  Entries keep their key's whole hash, so a key's hash() is never
+//recomputed, and equal() only runs when the whole hash matches.
+const int8_t HASH_CTRL_EMPTY = -128;
+const int8_t HASH_CTRL_DELETED = -2;
+const int HASH_GROUP = 16;
+
+inline int hash_lowest_bit(uint32_t m)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward(&i, m);
+	return (int)i;
+#else
+	return __builtin_ctz(m);
+#endif
+}
+
+//bit i of each mask is slot i of the group
+struct HashGroup
+{
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	__m128i ctrl;
+	HashGroup(const int8_t* p) :ctrl(_mm_loadu_si128((const __m128i*)p)) {}
+	uint32_t match(int8_t tag) const { return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl)); }
+	//EMPTY or DELETED, the only bytes below -1
+	uint32_t match_free() const { return (uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl)); }
+#else
+	const int8_t* ctrl;
+	HashGroup(const int8_t* p) :ctrl(p) {}
+	uint32_t match(int8_t tag) const
+	{
+		uint32_t m = 0;
+		for (int i = 0; i < HASH_GROUP; ++i) if (ctrl[i] == tag) m |= 1u << i;
+		return m;
+	}
+	uint32_t match_free() const
+	{
+		uint32_t m = 0;
+		for (int i = 0; i < HASH_GROUP; ++i) if (ctrl[i] < -1) m |= 1u << i;
+		return m;
+	}
+#endif
+	uint32_t match_empty() const { return match(HASH_CTRL_EMPTY); }
+};
+
 template<typename K, typename V>
 struct CollectableHashEntry 
 {
-	bool skip;
-	bool empty;
+	uint64_t hash;
 	InstancePtr<K> key;
 	InstancePtr<V> value;
-	CollectableHashEntry() :skip(false), empty(true) {}
+	CollectableHashEntry() :hash(0) {}
 	int total_instance_vars() const { return 2; }
 	InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &key; return &value; }
 };
 
+namespace GC {
+	template<typename K, typename V>
+	struct ZeroInit<CollectableHashEntry<K, V> > : std::true_type {};
+}
+
+//Groups are probed in triangular steps from the group the hash picks, which visits every group since there's a
+//power of 2 of them.  A probe stops at the first group with an EMPTY slot, so the table keeps at least 1/8 of its
+//slots EMPTY: growth_left counts the EMPTY slots that can still be filled, and erased slots become DELETED, which
+//don't give any back.  An erased slot can be EMPTY again if its group has an EMPTY one already, since every probe
+//that reaches the group stops there anyway.
+//A new array starts with all of max_used left to grow into and every entry moved across uses one up.  Moving
+//HASH_MIGRATE_STEP slots per operation empties the old array before the new one can run out of room.
 template<typename K, typename V>
 struct CollectableHashTable :public Collectable
 {
+	typedef CollectableHashEntry<K, V> Entry;
+	typedef CollectableInlineVector<Entry> Entries;
 	int HASH_SIZE;
+	//entries in both arrays
 	int used;
-	mutable int wasted;
-	InstancePtr<CollectableInlineVector<CollectableHashEntry<K,V>>> data;
-
+	int growth_left;
+	//HASH_SIZE bytes, only the table's own thread reads them, the collector only traces the entries
+	int8_t* ctrl;
+	InstancePtr<Entries> data;
+	//while resizing, the old array and how far through it the move has got
+	int OLD_HASH_SIZE;
+	int migrated;
+	int8_t* old_ctrl;
+	InstancePtr<Entries> old_data;
+
+	static int round_size(int s)
+	{
+		int size = HASH_GROUP;
+		while (size < s) size <<= 1;
+		return size;
+	}
+	static int max_used(int size) { return size - size / 8; }
+	static int8_t tag(uint64_t h) { return (int8_t)(h & 0x7f); }
+	static int8_t* new_ctrl(int size)
+	{
+		int8_t* c = new int8_t[size];
+		memset(c, HASH_CTRL_EMPTY, size);
+		GC::log_alloc(size);
+		return c;
+	}
 
-	CollectableHashTable(int s= INITIAL_HASH_SIZE) :HASH_SIZE(s), used(0), wasted(0), data(cnew2template(CollectableInlineVector<CollectableHashEntry<K,V>>(s))) {}
+	CollectableHashTable(int s = INITIAL_HASH_SIZE) :HASH_SIZE(round_size(s)), used(0), growth_left(max_used(HASH_SIZE)), ctrl(new_ctrl(HASH_SIZE)),
+		data(cnew(Entries(HASH_SIZE))), OLD_HASH_SIZE(0), migrated(0), old_ctrl(nullptr) {}
+	~CollectableHashTable() { delete[] ctrl; delete[] old_ctrl; }
 
-	void inc_used()
+	//the slot of the first EMPTY or DELETED entry on h's probe sequence
+	int find_free(uint64_t h) const
 	{
+		int mask = HASH_SIZE / HASH_GROUP - 1;
+		int g = (int)(h >> 7) & mask;
+		for (int step = 1;; ++step) {
+			uint32_t m = HashGroup(ctrl + g * HASH_GROUP).match_free();
+			if (m != 0) return g * HASH_GROUP + hash_lowest_bit(m);
+			g = (g + step) & mask;
+		}
+	}
+	//Starts moving the entries to a new array, twice the size unless they would fill less than half of it, which
+	//leaves the DELETED slots behind.  Entries carry their hashes, so nothing is hashed again.
+	void start_resize()
+	{
+		assert(old_data.get() == nullptr);
+		OLD_HASH_SIZE = HASH_SIZE;
+		if (used > max_used(HASH_SIZE) / 2) HASH_SIZE <<= 1;
+		old_ctrl = ctrl;
+		old_data = data;
+		ctrl = new_ctrl(HASH_SIZE);
+		data = cnew(Entries(HASH_SIZE));
+		growth_left = max_used(HASH_SIZE);
+		migrated = 0;
+	}
+	//moved slots are left DELETED, so probes in the old array still get past them
+	void migrate_some()
+	{
+		if (old_data.get() == nullptr) return;
+		int end = migrated + HASH_MIGRATE_STEP < OLD_HASH_SIZE ? migrated + HASH_MIGRATE_STEP : OLD_HASH_SIZE;
+		for (; migrated < end; ++migrated) {
+			if (old_ctrl[migrated] < 0) continue;
+			Entry* from = old_data[migrated];
+			int j = find_free(from->hash);
+			if (ctrl[j] == HASH_CTRL_EMPTY) --growth_left;
+			ctrl[j] = old_ctrl[migrated];
+			Entry* to = data[j];
+			to->hash = from->hash;
+			to->key = from->key;
+			to->value = from->value;
+			old_ctrl[migrated] = HASH_CTRL_DELETED;
+			from->key = nullptr;
+			from->value = nullptr;
+		}
+		if (migrated == OLD_HASH_SIZE) {
+			delete[] old_ctrl;
+			old_ctrl = nullptr;
+			old_data = nullptr;
+		}
+	}
+	//claims a free slot for a new entry with hash h, making room first if it would take the last EMPTY slot
+	int prepare_insert(uint64_t h)
+	{
+		int i = find_free(h);
+		if (ctrl[i] == HASH_CTRL_EMPTY && growth_left == 0) {
+			start_resize();
+			i = find_free(h);
+		}
+		if (ctrl[i] == HASH_CTRL_EMPTY) --growth_left;
+		ctrl[i] = tag(h);
 		++used;
-		if (((used+wasted) << 2) > HASH_SIZE)
-		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			RootPtr<CollectableInlineVector<CollectableHashEntry<K,V> > > t ( data);
-			data = cnew2template(CollectableInlineVector<CollectableHashEntry<K,V> >(HASH_SIZE));
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i]->empty && !t[i]->skip) insert_or_assign(t[i]->key, t[i]->value);
+		return i;
+	}
+	//the index of key in one array, or -1
+	int probe(const int8_t* c, Entries* d, int size, BorrowedPtr<K> key, uint64_t h) const
+	{
+		int mask = size / HASH_GROUP - 1;
+		int g = (int)(h >> 7) & mask;
+		for (int step = 1;; ++step) {
+			HashGroup group(c + g * HASH_GROUP);
+			for (uint32_t m = group.match(tag(h)); m != 0; m &= m - 1) {
+				int i = g * HASH_GROUP + hash_lowest_bit(m);
+				Entry* e = (*d)[i];
+				if (e->hash == h && e->key->equal(key.get())) return i;
 			}
+			if (group.match_empty() != 0) return -1;
+			g = (g + step) & mask;
 		}
 	}
-	bool findu(CollectableHashEntry<K, V>*&pair ,const RootPtr<K> &key, bool for_insert) const
+	//in_old says which array key was found in
+	bool findu(Entry*& pair, BorrowedPtr<K> key, uint64_t h, bool* in_old = nullptr) const
 	{
-		uint64_t h = key->hash();
-		int start = h & (HASH_SIZE - 1);
-		int i = start;
-		CollectableHashEntry<K, V>* recover=nullptr;
 		GC::safe_point();
-		do {
-			CollectableHashEntry<K, V>* e = data[i];
-			if (e->empty) {
-				if (recover != nullptr) {
-					pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else pair = e;
-				return false;
-			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
-			}
-			if (!skip && h == e->key->hash() && e->key->equal(key.get())) {
-				pair = e;
-				return true;
-			}
-
-			i = (i + 1) & (HASH_SIZE - 1);
-		} while (i != start);
-		return false;
+		if (in_old != nullptr) *in_old = false;
+		int i = probe(ctrl, data.get(), HASH_SIZE, key, h);
+		if (i >= 0) {
+			pair = data[i];
+			return true;
+		}
+		if (old_data.get() == nullptr) return false;
+		i = probe(old_ctrl, old_data.get(), OLD_HASH_SIZE, key, h);
+		if (i < 0) return false;
+		pair = old_data[i];
+		if (in_old != nullptr) *in_old = true;
+		return true;
 	}
 
-	bool contains(const RootPtr<K> &key) const {
-		CollectableHashEntry<K, V>* pair = nullptr;
-		return findu(pair, key, false);
+	bool contains(BorrowedPtr<K> key) const {
+		Entry* pair = nullptr;
+		return findu(pair, key, key->hash());
 	}
-	RootPtr<V> operator[](const RootPtr<K>& key)
+	RootPtr<V> operator[](BorrowedPtr<K> key)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		if (findu(pair, key, false)) {
+		Entry* pair = nullptr;
+		if (findu(pair, key, key->hash())) {
 
 			return pair->value;
 		}
 		return (V *)nullptr;
 	}
-	bool insert(const RootPtr<K>& key, const RootPtr<V>& value)
+	bool insert(BorrowedPtr<K> key, BorrowedPtr<V> value)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		if (!findu(pair, key, true)) {
-			pair->key = key;
-			pair->value = value;
-			pair->empty = false;
-			inc_used();
-			return true;
-		}
-		return false;
+		migrate_some();
+		Entry* pair = nullptr;
+		uint64_t h = key->hash();
+		if (findu(pair, key, h)) return false;
+		pair = data[prepare_insert(h)];
+		pair->hash = h;
+		pair->key = key;
+		pair->value = value;
+		return true;
 	}
-	void insert_or_assign(const RootPtr<K>& key, const RootPtr<V>& value)
+	//an entry that hasn't moved yet is changed where it is
+	void insert_or_assign(BorrowedPtr<K> key, BorrowedPtr<V> value)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		findu(pair, key, true);
-		bool replacing = !pair->empty;
-		pair->key = key;
+		migrate_some();
+		Entry* pair = nullptr;
+		uint64_t h = key->hash();
+		if (!findu(pair, key, h)) {
+			pair = data[prepare_insert(h)];
+			pair->hash = h;
+			pair->key = key;
+		}
 		pair->value = value;
-		pair->empty = false;
-
-		if (!replacing) inc_used();
 	}
-	bool erase(const RootPtr<K>& key)
+	bool erase(BorrowedPtr<K> key)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		if (findu(pair, key, false)) {
-			pair->skip = true;
-			pair->key = nullptr;
-			pair->value = nullptr;
-		pair->empty = true;
-			used = used - 1;
-			++wasted;
+		migrate_some();
+		Entry* pair = nullptr;
+		bool in_old;
+		if (!findu(pair, key, key->hash(), &in_old)) return false;
+		pair->key = nullptr;
+		pair->value = nullptr;
+		--used;
+		//the old array is never inserted into again, so it doesn't matter which its slot becomes
+		if (in_old) {
+			old_ctrl[pair - old_data[0]] = HASH_CTRL_DELETED;
 			return true;
 		}
-		return false;
+		int i = (int)(pair - data[0]);
+		if (HashGroup(ctrl + (i & ~(HASH_GROUP - 1))).match_empty() != 0) {
+			ctrl[i] = HASH_CTRL_EMPTY;
+			++growth_left;
+		}
+		else ctrl[i] = HASH_CTRL_DELETED;
+		return true;
 	}
 	int size() const { return used; }
 
 	virtual int total_instance_vars() const {
-		return 1;
+		return 2;
 	}
 	virtual size_t my_size() const { return sizeof(*this);  }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return num == 0 ? &data : &old_data; }
 };
 
 
@@ -443,7 +700,8 @@ struct HashTable :public Collectable
 		if (((used + wasted) << 2) > HASH_SIZE)
 		{
 			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
+			//when it's mostly erased entries, rehashing at the same size is enough to clear them out
+			if ((used << 3) > HASH_SIZE) HASH_SIZE <<= 1;
 			std::vector<HashEntry<K, V>> t = data;
 			data.clear();
 			data.resize(HASH_SIZE);
@@ -451,7 +709,7 @@ struct HashTable :public Collectable
 			wasted = 0;
 			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
 				GC::safe_point();
-				if (!t[i]-empty && !t[i]->skip) insert_or_assign(t[i]->key, t[i]->value);
+				if (!t[i].empty && !t[i].skip) insert_or_assign(t[i].key, t[i].value);
 			}
 		}
 	}
@@ -517,8 +775,8 @@ struct HashTable :public Collectable
 	void insert_or_assign(const K& key, const V& value)
 	{
 		HashEntry<K, V>* pair = nullptr;
-		findu(pair, key, true);
-		bool replacing = pair->key.get() != nullptr;
+		//a recovered tombstone isn't empty, but it's still a new entry
+		bool replacing = findu(pair, key, true);
 		pair->key = key;
 		pair->value = value;
 		pair->empty = false;
@@ -529,7 +787,6 @@ struct HashTable :public Collectable
 		HashEntry<K, V>* pair = nullptr;
 		if (findu(pair, key, false)) {
 			pair->skip = true;
-			pair->empty = true;
 			used = used - 1;
 			++wasted;
 			return true;
@@ -1,11 +1,21 @@
 #include <iostream>
 #include "Collectable.h"
 #include <cassert>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <vector>
 #ifdef _WIN32
 #include <Processthreadsapi.h>
+#pragma comment(lib, "Synchronization.lib")
 #else
 #include <sched.h>
 #endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /*
 Phase diagram
@@ -58,16 +68,16 @@ namespace GC {
     StateStoreType State;
 
     std::atomic_bool exit_program_flag;
-    int64_t MaxTriggerPoint;
-    std::atomic_int64_t TriggerPoint;
-    std::atomic_int64_t Allocated;
-    thread_local int64_t ThreadAllocated;
-    thread_local int AggregateLogAlloc;
-    thread_local int AggregateArrayLogAlloc;
+    //bytes that can still be handed out as budgets before the next collection is triggered, set by the pacer
+    std::atomic_int64_t AllocationPool;
+    thread_local int64_t AllocationBudget;
+    //set by the thread that runs the pool dry, so only one of them triggers, cleared once the pool is refilled
+    std::atomic_bool CollectionTriggered;
 
     bool single_thread_event = false;
 
-    thread_local void (*write_barrier)(SnapPtr*, void*);
+    DirtyLogChunk* DirtyLogsByThread[MAX_COLLECTED_THREADS];
+    thread_local DirtyLogChunk* DirtyLog;
 
     thread_local PhaseEnum ThreadState;
     thread_local int NotMutatingCount;
@@ -76,57 +86,162 @@ namespace GC {
     neosmart_event_t StartCollectionEvent;
     std::thread CollectionThread;
 
-    void one_collect();
-
-    void log_alloc(size_t a)
-    {
-        ThreadAllocated += a;
-        if (++AggregateLogAlloc > 300) {
-            AggregateLogAlloc = 0;
-            Allocated += ThreadAllocated;
-            ThreadAllocated = 0;
-            if (Allocated > TriggerPoint) {
-                if (Allocated.exchange(0) > TriggerPoint) {
-                    if (CombinedThread) single_thread_event = true;
-                    else SetEvent(StartCollectionEvent);
-                }
-            }
-        }
+    int MarkThreads = 1;
+    thread_local MarkDeque* ThreadMarkDeque;
+    thread_local MarkStack ThreadMarkStack;
+    bool MarkPrefetch = true;
+    uint8_t MarkEpoch = 1;
+    MarkDeque* MarkDeques;
+    //the parts of a collection that the helpers share with the collection thread
+    enum class CollectorJob { MARK, SWEEP, RESTORE, FINALIZE };
+    CollectorJob HelperJob;
+    //helper n waits on HelperEvents[n], slot 0 belongs to the collection thread and is unused
+    neosmart_event_t* HelperEvents;
+    std::thread* HelperThreads;
+    //the next thread slot, heap, or dirty log chunk, for a worker to take
+    std::atomic_int NextTask;
+    std::atomic_int MarkersIdle;
+    std::atomic_bool MarkersParked;
+    std::atomic_int HelpersDone;
+    std::atomic_int RootsRemoved;
+    std::atomic_int RootsScanned;
+    std::atomic_int64_t ObjectsSwept;
+    //every dirty log chunk, gathered before a restore pass so the workers can split them up
+    std::vector<DirtyLogChunk*> RestoreChunks;
+
+    int HeapGrowthPercent = 100;
+    int64_t HeapLimitBytes = 0;
+    int64_t MinHeapBytes = int64_t(64) << 20;
+    thread_local int64_t ThreadMarkedBytes;
+    //claimed so far by the mark that is running, and what the last one claimed
+    std::atomic_int64_t MarkedBytes;
+    std::atomic_int64_t MarkedObjects;
+    thread_local int64_t ThreadMarkedObjects;
+    std::atomic_int64_t LastLiveBytes;
+    int64_t AllocatedAtMarkStart;
+    int64_t PoolAtMarkStart;
+    //running average of what got allocated between a collection starting and its mark finishing
+    int64_t MarkRunway;
+
+    //the collection in progress, or the last one until its sweep is done and the record is published
+    Stats CurrentStats;
+    bool StatsPending;
+    uint64_t CollectionCount;
+    int64_t FreedAtSweepStart;
+
+    bool LazySweep = true;
+    int SweepChunk = 1;
+    //heaps that still have sweeping left, so allocation can skip looking
+    std::atomic_int SlotsToSweep;
+
+    bool ParkHandshakes = true;
+    //a waiter that parks bumps this first, so compare_set_state only makes the wake call when someone might be asleep
+    std::atomic_int StateWaiters;
+    //spins before parking, adapted per thread.  With one core the thread being waited for can't run while we spin.
+    const int MIN_HANDSHAKE_SPIN = 16;
+    int MaxHandshakeSpin;
+    const int HANDSHAKE_YIELDS = 2;
+    thread_local int HandshakeSpin = MIN_HANDSHAKE_SPIN;
+
+    //threads_not_mutating, threads_in_collection, threads_in_sweep and threads_out_of_collection come first in State
+    static_assert(offsetof(StateType, phase) == 4, "the state counters have to fill the first 32 bits of State");
+    inline uint32_t state_wait_word(StateStoreType s)
+    {
+        uint32_t w;
+        memcpy(&w, &s, sizeof(w));
+        return w;
     }
-    void log_array_alloc(size_t a, size_t n)
+    inline void cpu_relax()
     {
-        ThreadAllocated += a + n;
-        if (++AggregateArrayLogAlloc > 20) {
-            AggregateArrayLogAlloc = 0;
-            Allocated += ThreadAllocated;
-            ThreadAllocated = 0;
-            if (Allocated > TriggerPoint) {
-                if (Allocated.exchange(0) > TriggerPoint) {
-                    if (CombinedThread) single_thread_event = true;
-                    else SetEvent(StartCollectionEvent);
-                }
-            }
+#if defined(_WIN32)
+        YieldProcessor();
+#elif defined(__x86_64__)
+        _mm_pause();
+#endif
+    }
+    inline void yield_thread()
+    {
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif 
+    }
+    //sleeps while the 32 bits at word still hold seen, or until woken
+#if defined(_WIN32)
+    inline void park_on_word(volatile void* word, uint32_t seen) { WaitOnAddress(word, &seen, sizeof(seen), INFINITE); }
+    inline void wake_word(void* word) { WakeByAddressAll(word); }
+#elif defined(__linux__)
+    inline void park_on_word(volatile void* word, uint32_t seen) { syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0); }
+    inline void wake_word(void* word) { syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0); }
+#else
+    inline void park_on_word(volatile void*, uint32_t) { sched_yield(); }
+    inline void wake_word(void*) {}
+#endif
+    inline void park_on_state(uint32_t seen) { park_on_word(&State.store, seen); }
+    inline void wake_state_waiters() { wake_word(&State.store); }
+
+    //Waits like wait_state_change until done(), spinning and yielding a little before parking on counter.  Whatever
+    //makes done() true has to change counter and then wake it.  parked, if there is one, is set before each check
+    //so that others can tell someone may be asleep.
+    template<typename Done>
+    static void wait_on_counter(std::atomic_int& counter, std::atomic_bool* parked, Done done)
+    {
+        if (!ParkHandshakes) {
+            while (!done()) yield_thread();
+            return;
+        }
+        int spin = HandshakeSpin < MaxHandshakeSpin ? HandshakeSpin : MaxHandshakeSpin;
+        for (int i = 0; i < spin; ++i) {
+            if (done()) return;
+            cpu_relax();
         }
+        for (int i = 0; i < HANDSHAKE_YIELDS; ++i) {
+            yield_thread();
+            if (done()) return;
+        }
+        for (;;) {
+            uint32_t seen = (uint32_t)counter.load();
+            if (parked != nullptr) parked->store(true);
+            if (done()) return;
+            park_on_word(&counter, seen);
+        }
+    }
+
+    void one_collect();
+
+    //takes whole chunks until the budget is positive again, an allocation bigger than a chunk takes several at once
+    void refill_allocation_budget()
+    {
+        int64_t take = (-AllocationBudget / ALLOCATION_BUDGET_CHUNK + 1) * ALLOCATION_BUDGET_CHUNK;
+        AllocationBudget += take;
+        if (AllocationPool.fetch_sub(take) - take > 0) return;
+        if (CollectionTriggered.load(std::memory_order_relaxed) || CollectionTriggered.exchange(true)) return;
+        if (CombinedThread) single_thread_event = true;
+        else SetEvent(StartCollectionEvent);
     }
 
+    int64_t allocated_bytes() { return heap_allocated_bytes(); }
+    int64_t freed_bytes() { return FreedBytes; }
+    int64_t heap_bytes() { return heap_allocated_bytes() - FreedBytes; }
+    int64_t live_bytes() { return LastLiveBytes; }
+
 
-    void regular_write_barrier(SnapPtr* dest, void* v) {
-        assert(ThreadState != PhaseEnum::NOT_MUTATING);
-        assert(ThreadState != PhaseEnum::COLLECTING);
-        double_ptr_store(dest, v);
+    static DirtyLogChunk* new_dirty_log_chunk(DirtyLogChunk* next)
+    {
+        DirtyLogChunk* c = new DirtyLogChunk;
+        c->next = next;
+        c->count = 0;
+        return c;
     }
-    void collecting_write_barrier(SnapPtr* dest, void* v) {
-        assert(ThreadState != PhaseEnum::NOT_MUTATING);
-        assert(ThreadState == PhaseEnum::COLLECTING);
-        single_ptr_store(dest, v);
+    void grow_dirty_log()
+    {
+        DirtyLog = DirtyLogsByThread[MyThreadNumber] = new_dirty_log_chunk(DirtyLog);
     }
 
+    //the write barrier reads ThreadState directly
     void SetThreadState(PhaseEnum v) {
         ThreadState = v;
-        if (v == PhaseEnum::COLLECTING) {
-            write_barrier = collecting_write_barrier;
-        }
-        else write_barrier = regular_write_barrier;
     }
 
 
@@ -134,29 +249,18 @@ namespace GC {
 
     void merge_collected()
     {
-        /*
-    extern Collectable* ActiveCollectables[MAX_COLLECTED_THREADS*2];
-    extern thread_local RootLetterBase* ActiveRoots[MAX_COLLECTED_THREADS*2];
-    extern int ActiveIndex;
-    */
+        TraceScope trace("merge_collected");
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
             if (nullptr == ScanListsByThread[i]) continue;
-            Collectable* active_c = ScanListsByThread[i]->collectables[ActiveIndex];
-            Collectable* snapshot_c = ScanListsByThread[i]->collectables[(ActiveIndex^1)];
-            merge_from_to(snapshot_c, active_c);
-            //save the start before any new allocations
-            ScanListsByThread[i]->collectables[2]= static_cast<Collectable *>(ScanListsByThread[i]->collectables[ActiveIndex]->circular_double_list_next);
-            
             RootLetterBase* active_r = ScanListsByThread[i]->roots[ActiveIndex];
             RootLetterBase* snapshot_r = ScanListsByThread[i]->roots[(ActiveIndex ^ 1)];
             merge_from_to(snapshot_r, active_r);
-
-            ScanListsByThread[i]->roots[2] = static_cast<RootLetterBase*>(ScanListsByThread[i]->roots[ActiveIndex]->circular_double_list_next);
         }
  
     }
 
     void collect_thread();
+    void collector_helper_thread(int n);
 
     void init(bool combine_thread)
     {
@@ -169,11 +273,35 @@ namespace GC {
         ThreadsInGC.store(0, std::memory_order_seq_cst);
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
             ScanListsByThread[i] = nullptr;
+            HeapsByThread[i] = nullptr;
             ThreadSlots[i] = false;
         }
-        TriggerPoint = 300000000;
+        SlotsToSweep = 0;
+        ObjectsSwept = 0;
+        clear_handshake_histograms();
+        init_trace();
+        if (SweepChunk < 1) SweepChunk = 1;
+        AllocationPool = MinHeapBytes;
+        CollectionTriggered = false;
+        FreedBytes = 0;
+        LastLiveBytes = 0;
+        MarkRunway = 0;
+        MarkEpoch = 1;
+        MaxHandshakeSpin = std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+        init_slab_arena();
+        if (MarkThreads < 1) MarkThreads = 1;
+        if (MarkThreads > 1) {
+            MarkDeques = new MarkDeque[MarkThreads];
+            HelperEvents = new neosmart_event_t[MarkThreads];
+            HelperThreads = new std::thread[MarkThreads];
+            for (int i = 1; i < MarkThreads; ++i) {
+                HelperEvents[i] = CreateEvent();
+                HelperThreads[i] = std::thread(collector_helper_thread, i);
+            }
+        }
+        //a combined thread polls the event in safe_point
+        StartCollectionEvent = CreateEvent();
         if (!combine_thread) {
-            StartCollectionEvent = CreateEvent();
             CollectionThread = std::thread(collect_thread);
         }
         else {
@@ -184,9 +312,19 @@ namespace GC {
     void exit_collect_thread()
     {
         exit_program_flag = true;
+        wake_state_waiters();
+        //the counters change too, so that a marker or the collection thread about to park sees it
+        ++MarkersIdle;
+        wake_word(&MarkersIdle);
+        ++HelpersDone;
+        wake_word(&HelpersDone);
         SetEvent(StartCollectionEvent);
 
         if (!CombinedThread) CollectionThread.join();
+        for (int i = 1; i < MarkThreads; ++i) {
+            SetEvent(HelperEvents[i]);
+            HelperThreads[i].join();
+        }
     }
 
     /*
@@ -203,11 +341,40 @@ namespace GC {
     
     */
 
-    void _do_collection() 
+    void drain_mark_deque()
     {
-        int cr = 0, rr = 0;
-        //mark
-        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+        Collectable* c;
+        while (ThreadMarkDeque->pop(c)) c->collectable_trace();
+    }
+
+    bool steal_mark_work(int me)
+    {
+        Collectable* c;
+        for (int i = 1; i < MarkThreads; ++i) {
+            if (MarkDeques[(me + i) % MarkThreads].steal(c)) {
+                c->collectable_trace();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool any_mark_work()
+    {
+        for (int i = 0; i < MarkThreads; ++i) if (MarkDeques[i].size() > 0) return true;
+        return false;
+    }
+
+    //run by the collection thread and every mark helper.  The root lists are handed out one thread slot at a time,
+    //then markers that run dry steal from the others until every marker is idle at once.
+    void mark_worker(int me)
+    {
+        ThreadMarkDeque = MarkThreads > 1 ? &MarkDeques[me] : nullptr;
+        int rr = 0;
+        int rs = 0;
+        for (;;) {
+            int i = NextTask.fetch_add(1);
+            if (i >= MAX_COLLECTED_THREADS) break;
             if (nullptr == ScanListsByThread[i]) continue;
             auto it = ScanListsByThread[i]->roots[(ActiveIndex ^ 1)]->iterate();
 
@@ -215,89 +382,391 @@ namespace GC {
                 if (exit_program_flag) return;
                 if (static_cast<RootLetterBase*>(&*it)->was_owned) {
                     static_cast<RootLetterBase*>(&*it)->mark();
+                    ++rs;
+                    if (ThreadMarkDeque != nullptr) drain_mark_deque();
                     static_cast<RootLetterBase*>(&*it)->was_owned = static_cast<RootLetterBase*>(&*it)->owned;
                 }
-                if (!static_cast<RootLetterBase*>(&*it)->owned) {//special iterator lets you delete under it
+                //a letter whose RootPtr died during this collection can still be in a dirty log, so it goes next collection
+                else if (!static_cast<RootLetterBase*>(&*it)->owned && !static_cast<RootLetterBase*>(&*it)->pooled.load(std::memory_order_acquire)) {//special iterator lets you delete under it
                     it.remove();
                     ++rr;
                 }
             }
+        }
+        RootsRemoved += rr;
+        RootsScanned += rs;
+        if (ThreadMarkDeque == nullptr) return;
+        //idle markers hold no work, so once all of them are idle there is none left anywhere
+        for (;;) {
+            drain_mark_deque();
+            if (steal_mark_work(me)) continue;
+            //the last one to go idle wakes the others to finish
+            if (++MarkersIdle == MarkThreads) {
+                wake_word(&MarkersIdle);
+                return;
+            }
+            wait_on_counter(MarkersIdle, &MarkersParked, [] { return exit_program_flag || MarkersIdle == MarkThreads || any_mark_work(); });
+            if (exit_program_flag || MarkersIdle == MarkThreads) return;
+            --MarkersIdle;
+        }
+    }
 
+    //A wake can be missed when a marker parks just as work is shared.  That marker sleeps until the last one goes
+    //idle, which only costs parallelism, and the next marker to park sets MarkersParked again.
+    void wake_parked_markers()
+    {
+        if (MarkersParked.exchange(false)) wake_word(&MarkersIdle);
+    }
+
+    void MarkStack::spill()
+    {
+        MarkStackChunk* c = spare != nullptr ? spare : new MarkStackChunk;
+        spare = nullptr;
+        if (top != nullptr) {
+            top->next = overflow;
+            overflow = top;
         }
-        //sweep
-        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
-            if (nullptr == ScanListsByThread[i]) continue;
-            auto itc = ScanListsByThread[i]->collectables[(ActiveIndex ^ 1)]->iterate();
+        top = c;
+        count = 0;
+        capacity = MARK_STACK_SIZE;
+    }
 
-            while (++itc) {
-                if (exit_program_flag) return;
-                if (!static_cast<Collectable*>(&*itc)->collectable_marked && &*itc!= nullptr) {
-                    itc.remove();
-                    ++cr;
+    bool MarkStack::refill()
+    {
+        if (overflow == nullptr) return false;
+        delete spare;
+        spare = top;
+        top = overflow;
+        overflow = overflow->next;
+        count = MARK_STACK_SIZE;
+        return true;
+    }
+
+    void sweep_worker();
+    void restore_worker(bool fast);
+
+    static const char* JobNames[] = { "mark", "sweep", "restore", "finalize" };
+
+    static void run_job(CollectorJob job, int me)
+    {
+        TraceScope trace(JobNames[(int)job]);
+        switch (job) {
+        case CollectorJob::MARK:
+            mark_worker(me);
+            MarkedBytes += ThreadMarkedBytes;
+            MarkedObjects += ThreadMarkedObjects;
+            ThreadMarkedBytes = 0;
+            ThreadMarkedObjects = 0;
+            break;
+        case CollectorJob::SWEEP: sweep_worker(); break;
+        case CollectorJob::RESTORE: restore_worker(true); break;
+        case CollectorJob::FINALIZE: restore_worker(false); break;
+        }
+    }
+
+    void collector_helper_thread(int n)
+    {
+        trace_name_thread("collector helper", n);
+        for (;;) {
+            if (0 != WaitForEvent(HelperEvents[n])) return;
+            if (exit_program_flag) return;
+            run_job(HelperJob, n);
+            flush_freed_cells();
+            if (++HelpersDone == MarkThreads - 1) wake_word(&HelpersDone);
+        }
+    }
+
+    //runs a job on the collection thread and all MarkThreads - 1 helpers, and returns once every one of them is done
+    static void run_on_collector_threads(CollectorJob job)
+    {
+        HelperJob = job;
+        NextTask = 0;
+        HelpersDone = 0;
+        for (int i = 1; i < MarkThreads; ++i) SetEvent(HelperEvents[i]);
+        run_job(job, 0);
+        wait_on_counter(HelpersDone, nullptr, [] { return exit_program_flag || HelpersDone == MarkThreads - 1; });
+    }
+
+    static void lock_sweep(ThreadHeap* h)
+    {
+        while (h->sweep_lock.exchange(true, std::memory_order_acquire)) {
+yield_thread();
+        }
+    }
+    static void unlock_sweep(ThreadHeap* h)
+    {
+        h->sweep_lock.store(false, std::memory_order_release);
+    }
+
+    //Frees every cell of the slab whose mark byte is from an older epoch.  Only the mark map is read for a dead
+    //object registered with GC_NO_DESTRUCTOR, others have their destructor run first.  The byte is cleared before the
+    //cell goes back, and the owner only allocates cells whose byte is 0, so it can allocate from the slab meanwhile.
+    static int64_t sweep_slab(SlabHeader* s)
+    {
+        int64_t removed = 0;
+        uint8_t epoch = MarkEpoch;
+        size_t cell = slab_cell_size(s->size_class);
+        for (int i = 0; i < s->cell_count; ++i) {
+            uint8_t m = s->marks[i].load(std::memory_order_relaxed);
+            if (m == 0 || (m & MARK_EPOCH_BITS) == epoch) continue;
+            char* p = s->cells + i * cell;
+            if (!(m & MARK_NO_DESTRUCTOR)) destroy_collectable((Collectable*)p);
+            poison_collectable((Collectable*)p);
+            s->marks[i].store(0, std::memory_order_relaxed);
+            slab_free_cell(p);
+            ++removed;
+        }
+        if (removed != 0) FreedBytes += removed * (int64_t)cell;
+        return removed;
+    }
+
+    //The owner only pushes onto new_outside, so the sweep takes those over and has the whole list to itself.
+    //A 0 mark is an object whose constructor threw, its destructor can't run.
+    static int64_t sweep_outside(ThreadHeap* h)
+    {
+        int64_t removed = 0;
+        int64_t freed = 0;
+        uint8_t epoch = MarkEpoch;
+        OutsideHeader* kept = nullptr;
+        OutsideHeader** link = &kept;
+        OutsideHeader* lists[2] = { h->new_outside.exchange(nullptr, std::memory_order_acquire), h->outside };
+        for (OutsideHeader* o : lists) {
+            while (o != nullptr) {
+                OutsideHeader* next = o->next;
+                uint8_t m = o->mark.load(std::memory_order_relaxed);
+                if ((m & MARK_EPOCH_BITS) == epoch) {
+                    *link = o;
+                    link = &o->next;
                 }
                 else {
-                    static_cast<Collectable*>(&*itc)->collectable_marked = false;
-                    static_cast<Collectable*>(&*itc)->clean_after_collect();
+                    if (m != 0 && !(m & MARK_NO_DESTRUCTOR)) destroy_collectable((Collectable*)(o + 1));
+                    if (m != 0) poison_collectable((Collectable*)(o + 1));
+                    freed += int64_t(o->granules) << SLAB_GRANULE_BITS;
+                    ::operator delete(o);
+                    ++removed;
                 }
+                o = next;
             }
+        }
+        *link = nullptr;
+        h->outside = kept;
+        if (freed != 0) FreedBytes += freed;
+        return removed;
+    }
 
+    //sweeps up to n slabs of a heap, or its outside objects once the slabs are done.  The caller holds sweep_lock.
+    static int64_t sweep_heap(ThreadHeap* h, int n)
+    {
+        int64_t removed = 0;
+        while (h->sweeping.load(std::memory_order_relaxed) && n-- > 0) {
+            if (exit_program_flag) break;
+            if (h->sweep_cursor != nullptr) {
+                removed += sweep_slab(h->sweep_cursor);
+                h->sweep_cursor = h->sweep_cursor->next_slab;
+                continue;
+            }
+            removed += sweep_outside(h);
+            h->sweeping.store(false, std::memory_order_relaxed);
+            --SlotsToSweep;
         }
-        std::cout << rr << " roots removed " << cr << " objects removed\n";
+        return removed;
     }
 
+    //once marking is done every heap gets swept against the current epoch.  Slabs added after this only hold
+    //objects allocated since the collection started, which are all marked.
+    static void begin_sweep()
+    {
+        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+            ThreadHeap* h = HeapsByThread[i];
+            if (h == nullptr) continue;
+            lock_sweep(h);
+            assert(!h->sweeping);
+            h->sweep_cursor = h->slabs.load(std::memory_order_acquire);
+            h->sweeping.store(true, std::memory_order_relaxed);
+            ++SlotsToSweep;
+            unlock_sweep(h);
+        }
+    }
 
-    void _do_restore_snapshot()
+    bool lazy_sweep_step()
     {
+        if (SlotsToSweep.load(std::memory_order_relaxed) == 0) return false;
+        //most of what a thread frees came out of its own slabs, so its own heap goes first
+        for (int k = 0; k < MAX_COLLECTED_THREADS; ++k) {
+            ThreadHeap* h = HeapsByThread[(MyThreadNumber + k) % MAX_COLLECTED_THREADS];
+            if (h == nullptr || !h->sweeping.load(std::memory_order_relaxed)) continue;
+            if (h->sweep_lock.exchange(true, std::memory_order_acquire)) continue;
+            TraceScope trace("sweep chunk");
+            ObjectsSwept += sweep_heap(h, SweepChunk);
+            unlock_sweep(h);
+            flush_freed_cells();
+            return true;
+        }
+        return false;
+    }
 
-        if (CombinedThread && ThreadsInGC == 1) return;
-        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
-            if (nullptr == ScanListsByThread[i]) continue;
-            Collectable* snapshot_c = ScanListsByThread[i]->collectables[ActiveIndex];
-            auto t = ScanListsByThread[i]->collectables[2]->iterate();
-            assert(t);
-            while (t) {
-                if (exit_program_flag) return;
-                for (int j = static_cast<Collectable*>(&*t)->total_instance_vars() - 1; j >= 0; --j) {
-                    fast_restore(&(static_cast<Collectable*>(&*t)->index_into_instance_vars(j)->value));
-                }
-                ++t;
-            }            
-            t = ScanListsByThread[i]->roots[2]->iterate();
-            assert(t);
-            while (t) {
+    //each worker takes whole heaps, but sweeps them a chunk at a time so allocating threads can take chunks too
+    void sweep_worker()
+    {
+        for (;;) {
+            int i = NextTask.fetch_add(1);
+            if (i >= MAX_COLLECTED_THREADS) return;
+            ThreadHeap* h = HeapsByThread[i];
+            if (h == nullptr) continue;
+            while (h->sweeping.load(std::memory_order_relaxed)) {
                 if (exit_program_flag) return;
-                fast_restore(static_cast<RootLetterBase*>(&*t)->double_ptr());
-                ++t;
+                lock_sweep(h);
+                ObjectsSwept += sweep_heap(h, SweepChunk);
+                unlock_sweep(h);
+            }
+        }
+    }
+
+    //run by the collection thread and its helpers after a collection
+    void lazy_sweep()
+    {
+        TraceScope trace("lazy_sweep");
+        run_on_collector_threads(CollectorJob::SWEEP);
+        if (exit_program_flag) return;
+        flush_freed_cells();
+    }
+
+    //the current record's sweep is done, ObjectsSwept has counted whoever did it
+    static void publish_collection_stats()
+    {
+        if (!StatsPending) return;
+        StatsPending = false;
+        CurrentStats.sweep_end = trace_clock();
+        CurrentStats.objects_swept = ObjectsSwept.exchange(0);
+        CurrentStats.bytes_swept = FreedBytes - FreedAtSweepStart;
+        CurrentStats.heap_bytes_after_sweep = heap_bytes();
+        publish_stats(CurrentStats);
+    }
+
+    //Run once a mark is done.  The budget is counted from when the mark started, so what was live plus the budget
+    //is where the heap will be when the next collection triggers.  What has been handed out of the pool since then
+    //comes off it.
+    static void pace_next_collection()
+    {
+        int64_t live = MarkedBytes.exchange(0);
+        LastLiveBytes = live;
+        int64_t during_mark = heap_allocated_bytes() - AllocatedAtMarkStart;
+        if (during_mark < 0) during_mark = 0;
+        MarkRunway = MarkRunway == 0 ? during_mark : (MarkRunway * 3 + during_mark) / 4;
+        int64_t goal = live + live / 100 * HeapGrowthPercent;
+        if (goal < MinHeapBytes) goal = MinHeapBytes;
+        if (HeapLimitBytes != 0 && goal > HeapLimitBytes) goal = HeapLimitBytes;
+        //a quarter more runway than measured, for an allocation rate that is picking up
+        int64_t budget = goal - live - MarkRunway - MarkRunway / 4;
+        //a heap at or past its limit still gets some allocation between collections instead of collecting back to back
+        int64_t least = live / 32 > MinHeapBytes / 8 ? live / 32 : MinHeapBytes / 8;
+        if (budget < least) budget = least;
+        AllocationPool += budget - PoolAtMarkStart;
+        CollectionTriggered = false;
+        CurrentStats.bytes_marked = live;
+        CurrentStats.allocated_during_mark = during_mark;
+        CurrentStats.next_budget = budget;
+    }
+
+    void _do_collection() 
+    {
+        TraceScope trace("_do_collection");
+        //mark
+        MarkersIdle = 0;
+        MarkersParked = false;
+        RootsRemoved = 0;
+        RootsScanned = 0;
+        run_on_collector_threads(CollectorJob::MARK);
+        if (exit_program_flag) return;
+        CurrentStats.mark_end = trace_clock();
+        CurrentStats.objects_marked = MarkedObjects.exchange(0);
+        CurrentStats.roots_scanned = RootsScanned;
+        CurrentStats.roots_removed = RootsRemoved;
+        pace_next_collection();
+        FreedAtSweepStart = FreedBytes;
+        begin_sweep();
+        if (LazySweep) return;
+        //sweep
+        run_on_collector_threads(CollectorJob::SWEEP);
+        flush_freed_cells();
+    }
+
+    //the logs don't grow during either restore pass, so they can be split up by chunk
+    //returns how many slots they hold
+    static int64_t gather_restore_chunks()
+    {
+        int64_t slots = 0;
+        RestoreChunks.clear();
+        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+            for (DirtyLogChunk* c = DirtyLogsByThread[i]; c != nullptr; c = c->next) {
+                if (c->count != 0) RestoreChunks.push_back(c);
+                slots += c->count;
             }
         }
+        return slots;
+    }
+
+    void restore_worker(bool fast)
+    {
+        int n = (int)RestoreChunks.size();
+        for (;;) {
+            int k = NextTask.fetch_add(1);
+            if (k >= n) return;
+            if (exit_program_flag) return;
+            DirtyLogChunk* c = RestoreChunks[k];
+            if (fast) for (int j = 0; j < c->count; ++j) fast_restore(c->slots[j]);
+            else for (int j = 0; j < c->count; ++j) restore(c->slots[j]);
+        }
+    }
+
+    void _do_restore_snapshot()
+    {
+        TraceScope trace("_do_restore_snapshot");
+
+        if (CombinedThread && ThreadsInGC == 1) return;
+        CurrentStats.slots_restored = gather_restore_chunks();
+        run_on_collector_threads(CollectorJob::RESTORE);
     }
     void _do_finalize_snapshot()
     {
+        TraceScope trace("_do_finalize_snapshot");
         //std::cout << "actually about to finalize snapshot \n";
         if (CombinedThread && ThreadsInGC == 1) return;
+        CurrentStats.slots_finalized = gather_restore_chunks();
+        run_on_collector_threads(CollectorJob::FINALIZE);
+    }
+    //no thread logs again until the next collection starts, so the collector can empty the logs.
+    //Each slot keeps its newest chunk because its thread is still appending to it.
+    void clear_dirty_logs()
+    {
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
-            if (nullptr == ScanListsByThread[i]) continue;
-            if (exit_program_flag) return;
-            Collectable* snapshot_c = ScanListsByThread[i]->collectables[ActiveIndex];
-            auto t = ScanListsByThread[i]->collectables[2]->iterate();
-            assert(t);
-            while (t) {
-                for (int j = static_cast<Collectable*>(&*t)->total_instance_vars() - 1; j >= 0; --j) {
-                    restore(&(static_cast<Collectable*>(&*t)->index_into_instance_vars(j)->value));
-                }
-                ++t;
-            }
-            t = ScanListsByThread[i]->roots[2]->iterate();
-            assert(t);
-            while (t) {
-                restore(static_cast<RootLetterBase*>(&*t)->double_ptr());
-                ++t;
+            DirtyLogChunk* head = DirtyLogsByThread[i];
+            if (head == nullptr) continue;
+            DirtyLogChunk* c = head->next;
+            while (c != nullptr) {
+                DirtyLogChunk* n = c->next;
+                delete c;
+                c = n;
             }
+            head->next = nullptr;
+            head->count = 0;
         }
     }
 
     void _start_collection()
     {
+        TraceScope trace("_start_collection");
+        //the mark bytes are about to go stale, so whatever is left of the last sweep is done first
+        if (LazySweep) {
+            lazy_sweep();
+            if (exit_program_flag) return;
+        }
+        publish_collection_stats();
+        CurrentStats = Stats();
+        CurrentStats.cycle = ++CollectionCount;
+        CurrentStats.start = trace_clock();
+        CurrentStats.lazy_sweep = LazySweep;
+        StatsPending = true;
         StateStoreType gc = get_state();
         assert(gc.state.phase == PhaseEnum::NOT_COLLECTING);
 
@@ -313,7 +782,13 @@ namespace GC {
         while (true) {
             if (exit_program_flag) return;
             if (to.state.threads_out_of_collection == 1) {
-                if (!one_shot) ActiveIndex ^= 1;
+                if (!one_shot) {
+                    ActiveIndex ^= 1;
+                    //moving to a new epoch unmarks everything at once, and what gets allocated from here on is marked
+                    if (++MarkEpoch > MARK_EPOCH_BITS) MarkEpoch = 1;
+                    AllocatedAtMarkStart = heap_allocated_bytes();
+                    PoolAtMarkStart = AllocationPool;
+                }
                 one_shot = true;
                 //std::this_thread::sleep_for(std::chrono::milliseconds(1000));
                 do {
@@ -323,13 +798,10 @@ namespace GC {
                 released = true;
                 if (to.state.threads_out_of_collection == 0) break;
             }
-#ifdef _WIN32
-            SwitchToThread();
-#else
-            sched_yield();
-#endif 
-            to = get_state();
+            to = wait_state_change(to);
         }
+        CurrentStats.mark_start = trace_clock();
+        CurrentStats.start_handshake_wait = CurrentStats.mark_start - CurrentStats.start;
         if (CombinedThread && ThreadState !=PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::COLLECTING);
         _do_collection();
     }
@@ -342,6 +814,7 @@ namespace GC {
         Collectable* t=nullptr;
         RootLetterBase* r = nullptr;
         bool released = false;
+        CurrentStats.restore_start = trace_clock();
         do {
             to = gc;
             to.state.threads_in_collection++;//stop everyone till I'm done
@@ -349,6 +822,7 @@ namespace GC {
         } while (!compare_set_state(&gc, to));
         bool one_shot = false;
         while (true) {
+            if (exit_program_flag) return;
             if (to.state.threads_in_collection == 1) {
                 if (!one_shot) merge_collected();
                 one_shot = true;
@@ -360,24 +834,23 @@ namespace GC {
                 released = true;
                 if (to.state.threads_in_collection == 0) break;
             }
-#ifdef _WIN32
-            SwitchToThread();
-#else
-            sched_yield();
-#endif 
-            to = get_state();
+            to = wait_state_change(to);
         }
+        CurrentStats.restore_handshake_wait = trace_clock() - CurrentStats.restore_start;
         if (CombinedThread && ThreadState != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::RESTORING_SNAPSHOT);
         _do_restore_snapshot();
+        CurrentStats.restore_end = trace_clock();
         return;
     }
 
     void _end_sweep()
     {
+        TraceScope trace("_end_sweep");
         StateStoreType gc = get_state();
         assert(gc.state.phase == PhaseEnum::RESTORING_SNAPSHOT);
         StateStoreType to;
         bool released = false;
+        CurrentStats.finalize_start = trace_clock();
         do {
             if (exit_program_flag) return;
             to = gc;
@@ -396,16 +869,13 @@ namespace GC {
                 released = true;
                 if (to.state.threads_in_sweep == 0) break;
             }
-#ifdef _WIN32
-            SwitchToThread();
-#else
-            sched_yield();
-#endif 
-            to = get_state();
+            to = wait_state_change(to);
         }
+        CurrentStats.finalize_handshake_wait = trace_clock() - CurrentStats.finalize_start;
         if (CombinedThread && ThreadState != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::NOT_COLLECTING);
         _do_finalize_snapshot();
-
+        clear_dirty_logs();
+        CurrentStats.finalize_end = trace_clock();
     }
 
     StateStoreType get_state()
@@ -417,7 +887,47 @@ namespace GC {
 
     bool compare_set_state(StateStoreType* expected, StateStoreType to)
     {
-        return std::atomic_compare_exchange_weak(((AtomicGCStateWhole*)&State.store), &expected->store, to.store);
+        GCStateWhole was = expected->store;
+        if (!std::atomic_compare_exchange_weak(((AtomicGCStateWhole*)&State.store), &expected->store, to.store)) return false;
+        //parked threads sleep on the counters, so a change has to move at least one of them
+        assert(was == to.store || state_wait_word(*expected) != state_wait_word(to));
+        if (was != to.store && StateWaiters.load(std::memory_order_seq_cst) > 0) wake_state_waiters();
+        return true;
+    }
+
+    //Waits until State is no longer seen.  It spins first, for about as long as recent handshakes have taken to
+    //finish, then parks on the counter word of State until compare_set_state wakes it.
+    StateStoreType wait_state_change(StateStoreType seen)
+    {
+        StateStoreType now;
+        if (!ParkHandshakes) {
+yield_thread();
+            return get_state();
+        }
+        int spin = HandshakeSpin < MaxHandshakeSpin ? HandshakeSpin : MaxHandshakeSpin;
+        for (int i = 0; i < spin; ++i) {
+            now = get_state();
+            if (now.store != seen.store || exit_program_flag) {
+                HandshakeSpin += (2 * i + MIN_HANDSHAKE_SPIN - HandshakeSpin) / 8;
+                return now;
+            }
+            cpu_relax();
+        }
+        HandshakeSpin += (MIN_HANDSHAKE_SPIN - HandshakeSpin) / 8;
+        //the thread we're waiting for may just need our core
+        for (int i = 0; i < HANDSHAKE_YIELDS; ++i) {
+yield_thread();
+            now = get_state();
+            if (now.store != seen.store || exit_program_flag) return now;
+        }
+        ++StateWaiters;
+        for (;;) {
+            now = get_state();
+            if (now.store != seen.store || exit_program_flag) break;
+            park_on_state(state_wait_word(seen));
+        }
+        --StateWaiters;
+        return now;
     }
 
     //turns out that hazard pointers won't work because we would need a fence to make sure they're visible when we start collecting, and if we need a fence
@@ -425,6 +935,16 @@ namespace GC {
     //
     //count into collection to start gc or count out of collection to start sweep
     //
+    static const char* HandshakeNames[HANDSHAKE_KINDS] = { "start handshake", "restore handshake", "finalize handshake" };
+
+    //a mutator is through a handshake it started waiting in at start
+    static void mutator_waited(Handshake h, int64_t start)
+    {
+        int64_t end = trace_clock();
+        record_handshake(h, end - start);
+        if (TraceEvents) trace_event(HandshakeNames[(int)h], start, end);
+    }
+
     void safe_point()
     {
         if (CombinedThread) {
@@ -436,6 +956,7 @@ namespace GC {
         StateStoreType gc = get_state();
         StateStoreType to;
         if (ThreadState == gc.state.phase) return;
+        int64_t start = trace_clock();
         switch (ThreadState)
         {
         case PhaseEnum::NOT_MUTATING:
@@ -453,15 +974,10 @@ namespace GC {
             } while (!success);
             SetThreadState(PhaseEnum::RESTORING_SNAPSHOT);
             while (to.state.threads_in_collection > 0) {
-#ifdef _WIN32
-                if (exit_program_flag) return;
-                SwitchToThread();
-#else
-                sched_yield();
-#endif 
-                to = get_state();
+                to = wait_state_change(to);
                 if (exit_program_flag) return;
             }
+            mutator_waited(Handshake::RESTORE, start);
             return;
         }
         case PhaseEnum::RESTORING_SNAPSHOT:
@@ -476,14 +992,10 @@ namespace GC {
             } while (!success);
             SetThreadState(PhaseEnum::NOT_COLLECTING);
             while (to.state.threads_in_sweep > 0) {
-#ifdef _WIN32
-                SwitchToThread();
-#else
-                sched_yield();
-#endif 
-                to = get_state();
+                to = wait_state_change(to);
                 if (exit_program_flag) return;
             }
+            mutator_waited(Handshake::FINALIZE, start);
             return;
         }
         case PhaseEnum::NOT_COLLECTING:
@@ -497,14 +1009,10 @@ namespace GC {
             } while (!success);
             SetThreadState(PhaseEnum::COLLECTING);
             while (to.state.threads_out_of_collection > 0) {
-#ifdef _WIN32
-                SwitchToThread();
-#else
-                sched_yield();
-#endif 
-                to = get_state();
+                to = wait_state_change(to);
                 if (exit_program_flag) return;
             }
+            mutator_waited(Handshake::START, start);
             break;
         }
         }
@@ -531,17 +1039,18 @@ namespace GC {
         } while (MyThreadNumber == -1);
 
         ThreadsInGC++;
+        init_thread_heap(MyThreadNumber);
+        init_thread_histograms(MyThreadNumber);
+        if (DirtyLogsByThread[MyThreadNumber] == nullptr) DirtyLogsByThread[MyThreadNumber] = new_dirty_log_chunk(nullptr);
+        DirtyLog = DirtyLogsByThread[MyThreadNumber];
         if (ScanListsByThread[MyThreadNumber] == nullptr) {
             ScanLists* s = new ScanLists;
 
-            for (int i = 0; i < 2; ++i) {
-                s->collectables[i] = new CollectableSentinel();
-                s->collectables[i]->circular_double_list_is_sentinel = true;
-                s->roots[i] = new RootLetterBase(_SENTINEL_);
-            }
+            for (int i = 0; i < 2; ++i) s->roots[i] = new RootLetterBase(_SENTINEL_);
             ScanListsByThread[MyThreadNumber] = s;
         }
         CombinedThread = combine_thread;
+        trace_name_thread(combine_thread ? "mutator and collector" : "mutator", MyThreadNumber);
 
         NotMutatingCount = 1;
         thread_enter_mutation(true);
@@ -561,12 +1070,20 @@ namespace GC {
             {
                 to.state.threads_out_of_collection--;
             }
+            else if (ThreadState == PhaseEnum::RESTORING_SNAPSHOT)
+            {
+                to.state.threads_in_sweep--;
+            }
             else {
                 to.state.threads_not_mutating--;
             }
 
             success = compare_set_state(&gc, to);
         } while (!success);
+        //what is left of this thread's budget goes back for the others
+        AllocationPool += AllocationBudget;
+        AllocationBudget = 0;
+        retire_thread_histograms(MyThreadNumber);
         ThreadSlots[MyThreadNumber] = false;
 //        ThreadsInGC--;
     }
@@ -596,7 +1113,9 @@ namespace GC {
         do {
             StateStoreType to;
             to.state = gc.state;
-            switch (gc.state.phase) {
+            //the thread is counted under the phase it last moved into, which is behind State while it has a
+            //handshake it hasn't answered yet
+            switch (ThreadState) {
             case  PhaseEnum::NOT_COLLECTING:
                 --to.state.threads_out_of_collection;
                 break;
@@ -643,60 +1162,57 @@ namespace GC {
         } while (!success);
         SetThreadState(to.state.phase);
         if (CombinedThread) return;
+        //only a thread that lands in the middle of a handshake has a wait to record
+        int64_t start = 0;
         switch (to.state.phase)
         {
         case  PhaseEnum::NOT_COLLECTING:
+            if (to.state.threads_in_sweep > 0) start = trace_clock();
             while (to.state.threads_in_sweep > 0) {
-#ifdef _WIN32
-                SwitchToThread();
-#else
-                sched_yield();
-#endif 
-                to = get_state();
+                to = wait_state_change(to);
                 if (exit_program_flag) return;
             }
+            if (start != 0) mutator_waited(Handshake::FINALIZE, start);
             break;
         case  PhaseEnum::COLLECTING:
+            if (to.state.threads_out_of_collection > 0) start = trace_clock();
             while (to.state.threads_out_of_collection > 0) {
-#ifdef _WIN32
-                SwitchToThread();
-#else
-                sched_yield();
-#endif 
-                to = get_state();
+                to = wait_state_change(to);
                 if (exit_program_flag) return;
             }
+            if (start != 0) mutator_waited(Handshake::START, start);
             break;
         case  PhaseEnum::RESTORING_SNAPSHOT:
+            if (to.state.threads_in_collection > 0) start = trace_clock();
             while (to.state.threads_in_collection > 0) {
-#ifdef _WIN32
-                SwitchToThread();
-#else
-                sched_yield();
-#endif 
-                to = get_state();
+                to = wait_state_change(to);
                 if (exit_program_flag) return;
             }
+            if (start != 0) mutator_waited(Handshake::RESTORE, start);
         }
     }
 
     void one_collect()
     {
-        std::cout << "starting collection\n";
-        //if (TriggerPoint * 2 < MaxTriggerPoint) TriggerPoint.store(TriggerPoint*2,std::memory_order_release);
+        TraceScope trace("collection");
         _start_collection();
         if (exit_program_flag) return;
-        std::cout << "starting restore snapshot\n";
         _end_collection_start_restore_snapshot();
         if (exit_program_flag) return;
-        std::cout << "starting finalize snapshot\n";
         _end_sweep();
-        std::cout << "end collection\n";
+        CurrentStats.end = trace_clock();
+        //a combined thread leaves the sweeping to its allocations, and to the start of its next collection, which
+        //publishes this record
+        if (LazySweep && CombinedThread) return;
+        if (LazySweep) lazy_sweep();
+        if (exit_program_flag) return;
+        publish_collection_stats();
 
     }
 
     void collect_thread()
     {
+        trace_name_thread("collector");
         for (;;) {
             if (exit_program_flag) break;
            if (0 != WaitForEvent(StartCollectionEvent)) return; //there was an error, get out of here
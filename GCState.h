@@ -19,26 +19,22 @@
 //I use this because, on Windows, the events don't need a mutex, so the calls should be more efficient than using condition variables etc - no possible pause caused by contention over the mutex.
 #include "pevents/pevents.h"
 
+//glibc's own headers use __unused__ as an attribute name, so it can't be a macro there
 #ifdef _WIN32
 #define __unused__  [[maybe_unused]]
-#else
-#define __unused__ __attribute__((unused))
 #endif
 
-#if defined(_MSC_VER)
-/* Microsoft C/C++-compatible compiler */
-#include <intrin.h>
-
-#elif defined(__x86_64__)
-#include <x86intrin.h>
-#endif
+#include "SnapPtr.h"
+#include "GCStats.h"
+#include "GCTrace.h"
 //#include "LockFreeFIFO.h"
+#include "WorkStealingDeque.h"
 
 #define ENSURE(x) assert(x)
-#define cnew(A) ([&]{ auto * _AskdlfA_=new A;  GC::log_alloc(_AskdlfA_->my_size()); return _AskdlfA_; })()
-#define cnew2template(A,B) ([&]{ auto * _AskdlfA_=new A,B;  GC::log_alloc(_AskdlfA_->my_size()); return _AskdlfA_; })()
-#define cnew3template(A,B,C) ([&]{ auto * _AskdlfA_=new A,B,C;  GC::log_alloc(_AskdlfA_->my_size()); return _AskdlfA_; })()
-#define cnew_array(A,N) ([&]{ auto _NfjkasjdflN_ = N; auto _AskdlfA_=new A[_NfjkasjdflN_];  GC::log_array_alloc(_AskdlfA_[0]->my_size(),_NfjkasjdflN_); return _AskdlfA_; })()
+//the heap counts and charges collectables itself when they're allocated
+#define cnew(A) ([&]{ auto * _AskdlfA_=new A; GC::note_destructor(_AskdlfA_); return _AskdlfA_; })()
+#define cnew2template(A,B) ([&]{ auto * _AskdlfA_=new A,B; GC::note_destructor(_AskdlfA_); return _AskdlfA_; })()
+#define cnew3template(A,B,C) ([&]{ auto * _AskdlfA_=new A,B,C; GC::note_destructor(_AskdlfA_); return _AskdlfA_; })()
 
 #ifdef NDEBUG
 #define MEM_TEST()
@@ -47,64 +43,40 @@
 #endif
 
 class Collectable;
-class CollectableSentinel;
 
 namespace GC {
 
-    void log_alloc(size_t a);
-    void log_array_alloc(size_t a, size_t n);
-
-
-    typedef __m128i SnapPtr;
-
-    inline void double_ptr_store(SnapPtr* dest, void* v)
+    //Allocation is paced by a pool of bytes that can be allocated before the next collection is triggered.
+    //Each thread takes its budget from the pool ALLOCATION_BUDGET_CHUNK at a time, so the pool is only touched
+    //once per chunk, and the thread that runs the pool dry triggers the collection.
+    const int64_t ALLOCATION_BUDGET_CHUNK = 64 * 1024;
+    extern thread_local int64_t AllocationBudget;
+    void refill_allocation_budget();
+    inline void charge_allocation(int64_t bytes)
     {
-        SnapPtr temp;
-        temp.m128i_u64[1] = temp.m128i_u64[0] = (uint64_t)v;
-        _mm_store_si128(dest, temp);
+        if ((AllocationBudget -= bytes) < 0) refill_allocation_budget();
     }
+    //for memory that isn't a collectable but should bring the next collection closer, like a buffer a collectable owns
+    inline void log_alloc(size_t a) { charge_allocation((int64_t)a); }
+    inline void log_array_alloc(size_t a, size_t n) { charge_allocation((int64_t)(a * n)); }
+    //Exact counts in bytes of collectables, at their cell sizes, for the pacer and for reporting.
+    //allocated_bytes and freed_bytes are totals since init, heap_bytes is the difference, what has been allocated
+    //and not swept yet.  live_bytes is what the last mark found reachable.
+    int64_t allocated_bytes();
+    int64_t freed_bytes();
+    int64_t heap_bytes();
+    int64_t live_bytes();
 
-    inline void single_ptr_store(SnapPtr* dest, void* v)
-    {
-        dest->m128i_u64[0] = (uint64_t)v;
-    }
-    inline void* load(const SnapPtr* dest)
-    {
-        return (void*)dest->m128i_u64[0];
-    }
-    inline void* load_snapshot(const SnapPtr* dest)
-    {
-        return (void*)dest->m128i_u64[1];
-    }
-    inline SnapPtr double_ptr_swap(SnapPtr* dest, SnapPtr src)
-    {
-        SnapPtr cmp = _mm_load_si128(dest);
-        while (!_InterlockedCompareExchange128(&dest->m128i_i64[0], src.m128i_i64[1], src.m128i_i64[0], &cmp.m128i_i64[0]));
-        return cmp;
-    }
-    inline bool double_ptr_CAS(SnapPtr* dest, SnapPtr* expected, SnapPtr src)
-    {
-        return _InterlockedCompareExchange128(&dest->m128i_i64[0], src.m128i_i64[1], src.m128i_i64[0], &expected->m128i_i64[0]);
-    }
-    inline void fast_restore(SnapPtr* source)
-    {
-        if (source == nullptr) return;
-        SnapPtr temp = _mm_load_si128(source);
-        if (temp.m128i_i64[0] != temp.m128i_i64[1])source->m128i_i64[1] = temp.m128i_i64[0];
 
-    }
-    inline void restore(SnapPtr* source)
+    //While COLLECTING the write barrier only stores the live half of a SnapPtr.  The first time it makes a slot differ
+    //from its snapshot it logs the slot, so restoring the snapshot only has to visit the logged slots instead of the whole heap.
+    const int DIRTY_LOG_CHUNK = 1022;
+    struct DirtyLogChunk
     {
-        if (source == nullptr) return;
-        SnapPtr temp = _mm_load_si128(source);
-        do {
-            if (temp.m128i_i64[0] == temp.m128i_i64[1]) {
-                return;
-            }
-        } while (!_InterlockedCompareExchange128(&source->m128i_i64[0], temp.m128i_i64[0], temp.m128i_i64[0], &temp.m128i_i64[0]));
-    }
-
-    extern thread_local void (*write_barrier)(SnapPtr*, void*);
+        DirtyLogChunk* next;
+        int count;
+        SnapPtr* slots[DIRTY_LOG_CHUNK];
+    };
 
     enum class PhaseEnum : std::uint8_t
     {
@@ -143,15 +115,139 @@ namespace GC {
     extern thread_local bool CombinedThread;
 
     extern std::atomic_uint32_t ThreadsInGC;
+
+    //newest chunk first.  The head stays allocated, a thread that takes over the slot keeps appending to it.
+    extern DirtyLogChunk* DirtyLogsByThread[MAX_COLLECTED_THREADS];
+    extern thread_local DirtyLogChunk* DirtyLog;
+    //starts a new chunk when the current one is full
+    void grow_dirty_log();
+
+    inline void log_dirty(SnapPtr* dest)
+    {
+        if (DirtyLog->count == DIRTY_LOG_CHUNK) grow_dirty_log();
+        DirtyLog->slots[DirtyLog->count++] = dest;
+    }
+
+    //Every store to an InstancePtr or a root goes through here, so it's inlined and only branches on this thread's phase.
+    //While COLLECTING only the live half is written, otherwise both halves.
+    inline void write_barrier(SnapPtr* dest, void* v)
+    {
+        assert(ThreadState != PhaseEnum::NOT_MUTATING);
+        if (ThreadState != PhaseEnum::COLLECTING) {
+            double_ptr_store(dest, v);
+            return;
+        }
+        //a slot that's already dirty was logged by whoever dirtied it
+        if (load(dest) == load_snapshot(dest)) log_dirty(dest);
+        single_ptr_store(dest, v);
+    }
+
+    const int MARK_DEQUE_SIZE = 4096;
+    //while tracing, a marker keeps this many claimed objects in its deque where idle markers can steal them
+    const int MARK_SHARE_DEPTH = 16;
+    typedef WorkStealingDeque<Collectable*, MARK_DEQUE_SIZE> MarkDeque;
+
+    //number of threads that mark, sweep and restore during a collection, counting the collection thread.
+    //Marking shares work by stealing, sweeping hands out whole thread heaps and restoring hands out dirty log chunks.
+    //Set before GC::init.
+    extern int MarkThreads;
+    //null on the collector when it marks alone
+    extern thread_local MarkDeque* ThreadMarkDeque;
+    //set by a marker that is about to park for want of work, a marker that shares an object wakes it
+    extern std::atomic_bool MarkersParked;
+    void wake_parked_markers();
+
+    const int MARK_STACK_SIZE = 4096;
+    struct MarkStackChunk
+    {
+        MarkStackChunk* next;
+        Collectable* items[MARK_STACK_SIZE];
+    };
+    //Objects a marker has claimed but not traced yet, so marking keeps no state in the objects.  The stack is one
+    //chunk of MARK_STACK_SIZE.  When it fills up the whole chunk spills onto a list of overflow chunks, and the newest
+    //of those comes back when the stack runs dry.
+    struct MarkStack
+    {
+        MarkStackChunk* top;
+        int count;
+        //0 until the first chunk is allocated
+        int capacity;
+        MarkStackChunk* overflow;
+        //one empty chunk kept back, so a stack going up and down across a chunk boundary doesn't allocate every time
+        MarkStackChunk* spare;
+
+        void push(Collectable* c)
+        {
+            if (count == capacity) spill();
+            top->items[count++] = c;
+        }
+        bool pop(Collectable*& c)
+        {
+            if (count == 0 && !refill()) return false;
+            c = top->items[--count];
+            return true;
+        }
+        void spill();
+        bool refill();
+    };
+    extern thread_local MarkStack ThreadMarkStack;
+    //objects popped off the mark stack wait this many steps in a FIFO with their header prefetched before they're
+    //traced, so the marker isn't stalled on a cache miss for each one
+    const int MARK_PREFETCH_DEPTH = 8;
+    static_assert((MARK_PREFETCH_DEPTH & (MARK_PREFETCH_DEPTH - 1)) == 0, "the prefetch FIFO wraps with a mask");
+    //false traces each object as soon as it's popped, with no prefetch.  Set before GC::init.
+    extern bool MarkPrefetch;
+    inline void prefetch(const void* p)
+    {
+#if defined(_MSC_VER)
+        _mm_prefetch((const char*)p, _MM_HINT_T0);
+#else
+        __builtin_prefetch(p);
+#endif
+    }
+    //phase handshakes, idle markers and the collection thread waiting for its helpers park on a futex
+    //(WaitOnAddress on Windows) after a short spin.  false goes back to yielding in a loop, which burns cpu when
+    //there are more threads than cores.  Set before GC::init.
+    extern bool ParkHandshakes;
+    //a mark byte holding this epoch means marked in the current collection, or allocated since it started.
+    //Never 0, it moves on when a collection starts.
+    extern uint8_t MarkEpoch;
+    //Sweep after a collection instead of inside it.  The collection goes back to NOT_COLLECTING as soon as it has
+    //marked and restored, then the collection thread sweeps in chunks of SweepChunk slabs while the mutators run,
+    //and a thread that is about to take a new slab sweeps a chunk first.  Whatever is left gets finished before
+    //the next collection starts.  Set before GC::init.
+    extern bool LazySweep;
+    extern int SweepChunk;
+    //sweeps one chunk if there is lazy sweeping left, returns true if it did
+    bool lazy_sweep_step();
+
+    //The pacer sets how much can be allocated before the next collection starts, after every mark, from the bytes the
+    //mark found live.  Like GOGC, the heap is let grow HeapGrowthPercent past the live bytes before it's collected
+    //again.  HeapLimitBytes, if not 0, is a soft cap on that goal like GOMEMLIMIT.
+    //The collection is started early by about what got allocated while the last ones were marking, so that
+    //it's done marking by the time the heap reaches the goal.  The first collection comes after MinHeapBytes,
+    //and the goal is never lower than that.  However close the heap is to its goal, a collection isn't triggered
+    //until the larger of MinHeapBytes / 8 and 1/32 of the live bytes has been allocated since the last one.
+    //Set before GC::init.
+    extern int HeapGrowthPercent;
+    extern int64_t HeapLimitBytes;
+    extern int64_t MinHeapBytes;
+    //bytes and objects claimed by this thread in the current mark
+    extern thread_local int64_t ThreadMarkedBytes;
+    extern thread_local int64_t ThreadMarkedObjects;
     
     void exit_collect_thread();
     void init(bool combine_thread=false);
+    //runs a whole collection on the calling thread, for programs that called init(true)
+    void one_collect();
     void _start_collection();
     //waits until no threads are collecting
     void _end_collection_start_sweep();
     void _end_sweep();
     StateStoreType get_state();
     bool compare_set_state(StateStoreType* expected, StateStoreType to);
+    //blocks until State differs from seen and returns the new state
+    StateStoreType wait_state_change(StateStoreType seen);
     void safe_point();
     void init_thread(bool combine_thread=false);
     void exit_thread();
@@ -0,0 +1,197 @@
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <limits.h>
+#include "GCState.h"
+
+namespace GC {
+
+    void (*StatsCallback)(const Stats&) = nullptr;
+
+    //A slot's seq is odd while the collector writes it and 2 * cycle once it holds that cycle.  A reader copies the
+    //record between two loads of seq and keeps the copy if they match.
+    struct StatsSlot
+    {
+        std::atomic_uint64_t seq;
+        Stats stats;
+    };
+    static StatsSlot StatsRing[STATS_HISTORY];
+    static std::atomic_uint64_t LastStatsCycle;
+
+    void publish_stats(const Stats& s)
+    {
+        StatsSlot& slot = StatsRing[s.cycle % STATS_HISTORY];
+        slot.seq.store(s.cycle * 2 - 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.stats = s;
+        slot.seq.store(s.cycle * 2, std::memory_order_release);
+        LastStatsCycle.store(s.cycle, std::memory_order_release);
+        if (StatsCallback != nullptr) StatsCallback(s);
+    }
+
+    uint64_t last_stats_cycle()
+    {
+        return LastStatsCycle.load(std::memory_order_acquire);
+    }
+
+    bool get_stats(uint64_t cycle, Stats& out)
+    {
+        if (cycle == 0) return false;
+        StatsSlot& slot = StatsRing[cycle % STATS_HISTORY];
+        if (slot.seq.load(std::memory_order_acquire) != cycle * 2) return false;
+        out = slot.stats;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.seq.load(std::memory_order_relaxed) == cycle * 2;
+    }
+
+    static double micros(int64_t from, int64_t to) { return (to - from) / 1000.0; }
+
+    void print_stats(const Stats& s)
+    {
+        std::cout << "collection " << s.cycle << ": " << s.roots_scanned << " roots scanned " << s.roots_removed << " removed, "
+            << s.objects_marked << " objects marked (" << s.bytes_marked << " bytes) in " << micros(s.mark_start, s.mark_end) << " us\n";
+        std::cout << "  restored " << s.slots_restored << " slots in " << micros(s.restore_start, s.restore_end) << " us, finalized "
+            << s.slots_finalized << " in " << micros(s.finalize_start, s.finalize_end) << " us, handshakes waited "
+            << micros(0, s.start_handshake_wait) << " / " << micros(0, s.restore_handshake_wait) << " / " << micros(0, s.finalize_handshake_wait) << " us\n";
+        std::cout << "  " << s.objects_swept << " objects removed (" << s.bytes_swept << " bytes)" << (s.lazy_sweep ? " by lazy sweep, " : ", ")
+            << s.heap_bytes_after_sweep << " bytes in the heap, " << s.allocated_during_mark << " allocated while marking, next collection after "
+            << s.next_budget << " bytes\n";
+    }
+
+    void LatencyHistogram::clear()
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) counts[i] = 0;
+        total = 0;
+        highest = 0;
+    }
+
+    void LatencyHistogram::add(const LatencyHistogram& o)
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) counts[i] += o.counts[i];
+        total += o.total;
+        if (o.highest > highest) highest = o.highest;
+    }
+
+    int LatencyHistogram::bucket(int64_t ns)
+    {
+        if (ns < LATENCY_SUB_BUCKETS) return ns < 0 ? 0 : (int)ns;
+#if defined(_MSC_VER)
+        unsigned long e;
+        _BitScanReverse64(&e, (uint64_t)ns);
+#else
+        int e = 63 - __builtin_clzll((uint64_t)ns);
+#endif
+        int shift = (int)e - LATENCY_SUB_BUCKET_BITS;
+        return (shift + 1) * LATENCY_SUB_BUCKETS + (int)((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    }
+
+    int64_t LatencyHistogram::bucket_top(int b)
+    {
+        if (b < LATENCY_SUB_BUCKETS) return b;
+        int shift = b / LATENCY_SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS) << shift;
+        uint64_t top = low + ((uint64_t)1 << shift) - 1;
+        return top > (uint64_t)LLONG_MAX ? LLONG_MAX : (int64_t)top;
+    }
+
+    int64_t LatencyHistogram::percentile(double q) const
+    {
+        if (total == 0) return 0;
+        uint64_t want = (uint64_t)(q * total + 0.5);
+        if (want < 1) want = 1;
+        if (want > total) want = total;
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= want) return bucket_top(i) < highest ? bucket_top(i) : highest;
+        }
+        return highest;
+    }
+
+    //a slot's histograms, written only by the thread in the slot, so the counters are bumped without a locked add
+    struct ThreadHandshakeHistograms
+    {
+        std::atomic<uint64_t> counts[HANDSHAKE_KINDS][LATENCY_BUCKETS];
+        std::atomic<uint64_t> total[HANDSHAKE_KINDS];
+        std::atomic<int64_t> highest[HANDSHAKE_KINDS];
+    };
+    static ThreadHandshakeHistograms* HistogramsByThread[MAX_COLLECTED_THREADS];
+    static LatencyHistogram ExitedHistograms[HANDSHAKE_KINDS];
+    static std::mutex ExitedLock;
+
+    static void bump(std::atomic<uint64_t>& c)
+    {
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void record_handshake(Handshake h, int64_t ns)
+    {
+        ThreadHandshakeHistograms* t = HistogramsByThread[MyThreadNumber];
+        int k = (int)h;
+        bump(t->counts[k][LatencyHistogram::bucket(ns)]);
+        bump(t->total[k]);
+        if (ns > t->highest[k].load(std::memory_order_relaxed)) t->highest[k].store(ns, std::memory_order_relaxed);
+    }
+
+    static void copy_histogram(ThreadHandshakeHistograms* t, int k, LatencyHistogram& out)
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; ++i) out.counts[i] = t->counts[k][i].load(std::memory_order_relaxed);
+        out.total = t->total[k].load(std::memory_order_relaxed);
+        out.highest = t->highest[k].load(std::memory_order_relaxed);
+    }
+
+    void handshake_histogram(int thread, Handshake h, LatencyHistogram& out)
+    {
+        int k = (int)h;
+        out.clear();
+        if (thread >= 0) {
+            if (HistogramsByThread[thread] != nullptr) copy_histogram(HistogramsByThread[thread], k, out);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(ExitedLock);
+            out.add(ExitedHistograms[k]);
+        }
+        LatencyHistogram one;
+        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+            if (HistogramsByThread[i] == nullptr) continue;
+            copy_histogram(HistogramsByThread[i], k, one);
+            out.add(one);
+        }
+    }
+
+    static void clear_thread_histograms(ThreadHandshakeHistograms* t)
+    {
+        for (int k = 0; k < HANDSHAKE_KINDS; ++k) {
+            for (int i = 0; i < LATENCY_BUCKETS; ++i) t->counts[k][i].store(0, std::memory_order_relaxed);
+            t->total[k].store(0, std::memory_order_relaxed);
+            t->highest[k].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void clear_handshake_histograms()
+    {
+        std::lock_guard<std::mutex> lock(ExitedLock);
+        for (int k = 0; k < HANDSHAKE_KINDS; ++k) ExitedHistograms[k].clear();
+        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+            if (HistogramsByThread[i] != nullptr) clear_thread_histograms(HistogramsByThread[i]);
+        }
+    }
+
+    void init_thread_histograms(int thread)
+    {
+        if (HistogramsByThread[thread] == nullptr) HistogramsByThread[thread] = new ThreadHandshakeHistograms();
+    }
+
+    void retire_thread_histograms(int thread)
+    {
+        ThreadHandshakeHistograms* t = HistogramsByThread[thread];
+        LatencyHistogram one;
+        std::lock_guard<std::mutex> lock(ExitedLock);
+        for (int k = 0; k < HANDSHAKE_KINDS; ++k) {
+            copy_histogram(t, k, one);
+            ExitedHistograms[k].add(one);
+        }
+        clear_thread_histograms(t);
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Per collection statistics, in place of the collector printing its progress.
+
+The collection thread fills in one Stats record per collection and publishes it once the collection's sweep is
+done: at the end of one_collect, or for a combined thread sweeping lazily, when its next collection starts.
+Publishing copies the record into a ring of the last STATS_HISTORY records, which any thread can read without
+a lock through get_stats, and then calls StatsCallback if one is set, on the collection thread.
+
+Times are GC::trace_clock nanoseconds.  A handshake wait is how long the collector waited on the mutators to see a
+phase change, counted from its CAS on State until the last of them had.
+
+The mutators' side of the handshakes goes into latency histograms kept per thread slot.  Every phase change a
+mutator makes in safe_point is recorded, from its CAS until the counter it waits on drains, and so is a wait in
+thread_enter_mutation when it has one.  Only the owner writes its slot, anyone can read them at any time.
+*/
+
+namespace GC {
+
+    struct Stats
+    {
+        //counts from 1
+        uint64_t cycle;
+        int64_t start;
+        int64_t mark_start;
+        int64_t mark_end;
+        int64_t restore_start;
+        int64_t restore_end;
+        int64_t finalize_start;
+        int64_t finalize_end;
+        //the snapshot is finalized, only sweeping can be left
+        int64_t end;
+        int64_t sweep_end;
+        int64_t start_handshake_wait;
+        int64_t restore_handshake_wait;
+        int64_t finalize_handshake_wait;
+        //root letters that were traced from and ones whose RootPtr was gone
+        int64_t roots_scanned;
+        int64_t roots_removed;
+        int64_t objects_marked;
+        int64_t bytes_marked;
+        int64_t objects_swept;
+        int64_t bytes_swept;
+        //dirty slots put back in the restore pass and in the finalize pass
+        int64_t slots_restored;
+        int64_t slots_finalized;
+        //the pacer's inputs and what it decided
+        int64_t allocated_during_mark;
+        int64_t next_budget;
+        int64_t heap_bytes_after_sweep;
+        bool lazy_sweep;
+    };
+
+    const int STATS_HISTORY = 64;
+    //called on the collection thread with every published record.  Set before GC::init.
+    extern void (*StatsCallback)(const Stats&);
+    //the cycle of the newest published record, 0 before the first
+    uint64_t last_stats_cycle();
+    //false if that cycle hasn't been published yet or has already been overwritten in the ring
+    bool get_stats(uint64_t cycle, Stats& out);
+    //run by the collection thread once a collection's sweep is done
+    void publish_stats(const Stats& s);
+    //prints a record to cout the way the collector used to log, for StatsCallback
+    void print_stats(const Stats& s);
+
+    //the phase a mutator moves into, COLLECTING, RESTORING_SNAPSHOT or NOT_COLLECTING
+    enum class Handshake : uint8_t { START, RESTORE, FINALIZE };
+    const int HANDSHAKE_KINDS = 3;
+
+    //HdrHistogram style: 16 linear buckets to each power of 2 of nanoseconds, so a value is within 1/16 of the top
+    //of its bucket, and every value up to 2^63 fits
+    const int LATENCY_SUB_BUCKET_BITS = 4;
+    const int LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+    const int LATENCY_BUCKETS = (64 - LATENCY_SUB_BUCKET_BITS) * LATENCY_SUB_BUCKETS;
+    struct LatencyHistogram
+    {
+        uint64_t counts[LATENCY_BUCKETS];
+        uint64_t total;
+        int64_t highest;
+
+        void clear();
+        void add(const LatencyHistogram& o);
+        //the top of the bucket holding the value at quantile q, from 0 to 1, but never more than highest
+        int64_t percentile(double q) const;
+        static int bucket(int64_t ns);
+        static int64_t bucket_top(int b);
+    };
+    void record_handshake(Handshake h, int64_t ns);
+    //copies the histogram of the thread in that slot, or with thread -1 of every thread so far, exited ones included
+    void handshake_histogram(int thread, Handshake h, LatencyHistogram& out);
+    //empties every histogram, GC::init starts with this
+    void clear_handshake_histograms();
+    //run by init_thread and exit_thread.  A thread that exits adds its histograms to the exited ones, so the next
+    //thread in its slot starts from empty.
+    void init_thread_histograms(int thread);
+    void retire_thread_histograms(int thread);
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include "GCTrace.h"
+
+namespace GC {
+
+    bool TraceEvents = false;
+    int TraceChunksPerThread = 16;
+    int TraceExitedThreads = 16;
+
+    struct TraceChunk
+    {
+        TraceChunk* next;
+        //events below this are finished, the owner publishes it after writing each one
+        std::atomic_int count;
+        TraceEvent events[TRACE_CHUNK];
+    };
+
+    struct TraceBuffer
+    {
+        int tid;
+        char name[48];
+        bool exited;
+        int chunks;
+        //events at the start of first that clear_trace dropped
+        int skip;
+        TraceChunk* first;
+        //only the owner changes this
+        TraceChunk* last;
+        TraceBuffer* next;
+    };
+
+    //Guards the list of buffers and every buffer's list of chunks.  An owner only takes it to move on to another
+    //chunk, and readers hold it the whole time they read, so a chunk is never reused or freed under a reader.
+    static std::mutex TraceLock;
+    //every buffer that's kept, newest first
+    static TraceBuffer* TraceBuffers;
+    static int ExitedBuffers;
+    static std::atomic_int NextTraceTid;
+    static int64_t TraceOrigin;
+
+    static TraceChunk* new_trace_chunk()
+    {
+        TraceChunk* c = new TraceChunk;
+        c->next = nullptr;
+        c->count.store(0, std::memory_order_relaxed);
+        return c;
+    }
+
+    static void free_trace_chunks(TraceChunk* c, TraceChunk* end)
+    {
+        while (c != end) {
+            TraceChunk* next = c->next;
+            delete c;
+            c = next;
+        }
+    }
+
+    //the oldest exited buffers past TraceExitedThreads, called with TraceLock held
+    static void trim_exited_buffers()
+    {
+        while (ExitedBuffers > TraceExitedThreads) {
+            TraceBuffer** oldest = nullptr;
+            for (TraceBuffer** b = &TraceBuffers; *b != nullptr; b = &(*b)->next) if ((*b)->exited) oldest = b;
+            TraceBuffer* gone = *oldest;
+            *oldest = gone->next;
+            free_trace_chunks(gone->first, nullptr);
+            delete gone;
+            --ExitedBuffers;
+        }
+    }
+
+    //marks the thread's buffer exited when the thread ends
+    struct TraceThread
+    {
+        TraceBuffer* buffer = nullptr;
+        ~TraceThread()
+        {
+            if (buffer == nullptr) return;
+            std::lock_guard<std::mutex> lock(TraceLock);
+            buffer->exited = true;
+            ++ExitedBuffers;
+            trim_exited_buffers();
+        }
+    };
+    static thread_local TraceThread MyTrace;
+
+    static TraceBuffer* my_trace_buffer()
+    {
+        if (MyTrace.buffer != nullptr) return MyTrace.buffer;
+        TraceBuffer* b = new TraceBuffer;
+        b->tid = ++NextTraceTid;
+        snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+        b->exited = false;
+        b->chunks = 1;
+        b->skip = 0;
+        b->first = b->last = new_trace_chunk();
+        {
+            std::lock_guard<std::mutex> lock(TraceLock);
+            b->next = TraceBuffers;
+            TraceBuffers = b;
+        }
+        MyTrace.buffer = b;
+        return b;
+    }
+
+    //the next chunk for the owner to fill, its oldest one once it has TraceChunksPerThread
+    static TraceChunk* next_trace_chunk(TraceBuffer* b)
+    {
+        std::lock_guard<std::mutex> lock(TraceLock);
+        TraceChunk* c;
+        if (b->chunks >= TraceChunksPerThread && b->first != b->last) {
+            c = b->first;
+            b->first = c->next;
+            b->skip = 0;
+            c->next = nullptr;
+            c->count.store(0, std::memory_order_relaxed);
+        }
+        else {
+            c = new_trace_chunk();
+            ++b->chunks;
+        }
+        b->last->next = c;
+        b->last = c;
+        return c;
+    }
+
+    void init_trace()
+    {
+        TraceOrigin = trace_clock();
+    }
+
+    void trace_event(const char* name, int64_t start, int64_t end)
+    {
+        TraceBuffer* b = my_trace_buffer();
+        TraceChunk* c = b->last;
+        int n = c->count.load(std::memory_order_relaxed);
+        if (n == TRACE_CHUNK) {
+            c = next_trace_chunk(b);
+            n = 0;
+        }
+        c->events[n].name = name;
+        c->events[n].start = start;
+        c->events[n].end = end;
+        c->count.store(n + 1, std::memory_order_release);
+    }
+
+    //a name can change while the trace is written, the writer gets one or the other
+    void trace_name_thread(const char* name, int n)
+    {
+        if (!TraceEvents) return;
+        TraceBuffer* b = my_trace_buffer();
+        if (n < 0) snprintf(b->name, sizeof(b->name), "%s", name);
+        else snprintf(b->name, sizeof(b->name), "%s %d", name, n);
+    }
+
+    //an owner can finish another event while this runs, it goes next time
+    void clear_trace()
+    {
+        std::lock_guard<std::mutex> lock(TraceLock);
+        for (TraceBuffer** b = &TraceBuffers; *b != nullptr;) {
+            TraceBuffer* t = *b;
+            if (t->exited) {
+                *b = t->next;
+                free_trace_chunks(t->first, nullptr);
+                delete t;
+                continue;
+            }
+            free_trace_chunks(t->first, t->last);
+            t->first = t->last;
+            t->chunks = 1;
+            t->skip = t->last->count.load(std::memory_order_acquire);
+            b = &t->next;
+        }
+        ExitedBuffers = 0;
+    }
+
+    void for_each_trace_event(const std::function<void(int tid, const char* thread, const TraceEvent& e)>& f)
+    {
+        std::lock_guard<std::mutex> lock(TraceLock);
+        for (TraceBuffer* b = TraceBuffers; b != nullptr; b = b->next) {
+            char name[sizeof(b->name)];
+            memcpy(name, b->name, sizeof(name));
+            name[sizeof(name) - 1] = 0;
+            for (TraceChunk* c = b->first; c != nullptr; c = c->next) {
+                int n = c->count.load(std::memory_order_acquire);
+                for (int i = c == b->first ? b->skip : 0; i < n; ++i) f(b->tid, name, c->events[i]);
+            }
+        }
+    }
+
+    //thread names can come from the program, so quotes, backslashes and control characters are escaped
+    static void write_json_string(FILE* f, const char* s)
+    {
+        fputc('"', f);
+        for (; *s != 0; ++s) {
+            unsigned char c = (unsigned char)*s;
+            if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+            else if (c < 0x20) fprintf(f, "\\u%04x", c);
+            else fputc(c, f);
+        }
+        fputc('"', f);
+    }
+
+    bool write_chrome_trace(const char* path)
+    {
+        FILE* f = fopen(path, "w");
+        if (f == nullptr) return false;
+        fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool comma = false;
+        std::lock_guard<std::mutex> lock(TraceLock);
+        for (TraceBuffer* b = TraceBuffers; b != nullptr; b = b->next) {
+            char name[sizeof(b->name)];
+            memcpy(name, b->name, sizeof(name));
+            name[sizeof(name) - 1] = 0;
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", comma ? ",\n" : "", b->tid);
+            write_json_string(f, name);
+            fprintf(f, "}}");
+            comma = true;
+            for (TraceChunk* c = b->first; c != nullptr; c = c->next) {
+                int n = c->count.load(std::memory_order_acquire);
+                for (int i = c == b->first ? b->skip : 0; i < n; ++i) {
+                    const TraceEvent& e = c->events[i];
+                    fprintf(f, ",\n{\"name\":");
+                    write_json_string(f, e.name);
+                    fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        b->tid, (e.start - TraceOrigin) / 1000.0, (e.end - e.start) / 1000.0);
+                }
+            }
+        }
+        fprintf(f, "\n]}\n");
+        return fclose(f) == 0;
+    }
+}
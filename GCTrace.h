@@ -0,0 +1,63 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <chrono>
+
+/*
+Optional timeline of what the collector and the mutators were doing, written out as Chrome trace JSON, which
+chrome://tracing and Perfetto both open.
+
+With TraceEvents set, the collector's phases, the jobs each collector thread runs, and every wait a mutator
+has in a handshake are recorded as complete events (a start and an end) into a buffer per thread.  Only the owner
+appends to its buffer, and each chunk publishes its count, so write_chrome_trace can run at any time and gets
+every event that was finished when it looked.
+
+A buffer is a ring of at most TraceChunksPerThread chunks, so a long running thread keeps only its latest events.
+Buffers are kept after their thread exits, so the trace still shows it, but only the last TraceExitedThreads of
+those, so threads coming and going don't add up.  clear_trace drops everything recorded so far.
+*/
+
+namespace GC {
+
+    //set before GC::init, off costs a test of this in each traced scope
+    extern bool TraceEvents;
+    //set before GC::init, each chunk holds TRACE_CHUNK events
+    extern int TraceChunksPerThread;
+    extern int TraceExitedThreads;
+
+    const int TRACE_CHUNK = 4096;
+    struct TraceEvent
+    {
+        //a string literal, events only keep the pointer
+        const char* name;
+        int64_t start;
+        int64_t end;
+    };
+
+    //steady_clock nanoseconds, Stats times come from it too
+    inline int64_t trace_clock()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    void trace_event(const char* name, int64_t start, int64_t end);
+    //the name this thread gets in the trace, n is appended unless it's negative
+    void trace_name_thread(const char* name, int n = -1);
+
+    struct TraceScope
+    {
+        const char* name;
+        int64_t start;
+        TraceScope(const char* n) :name(n), start(TraceEvents ? trace_clock() : 0) {}
+        ~TraceScope() { if (TraceEvents) trace_event(name, start, trace_clock()); }
+    };
+
+    //calls f with every event that was finished when it looked, and the id and name of the thread it's from
+    void for_each_trace_event(const std::function<void(int tid, const char* thread, const TraceEvent& e)>& f);
+    //timestamps are relative to GC::init.  Returns false if the file couldn't be written.
+    bool write_chrome_trace(const char* path);
+    //forgets every event recorded so far and the buffers of threads that have exited
+    void clear_trace();
+    //run by GC::init, it sets where the timestamps count from
+    void init_trace();
+}
@@ -0,0 +1,243 @@
+#include "SlabAllocator.h"
+#include <new>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace GC {
+
+    ThreadHeap* HeapsByThread[MAX_COLLECTED_THREADS];
+    std::atomic_int64_t FreedBytes;
+    bool UseSlabAllocator = true;
+    size_t SlabArenaBytes = size_t(64) << 30;
+    uintptr_t SlabArenaBase;
+    std::atomic<size_t> SlabArenaUsed;
+
+    struct PendingFree
+    {
+        SlabFreeCell* head;
+        SlabFreeCell* tail;
+        int count;
+    };
+
+    //cells this (sweeping) thread has freed but not yet handed back, indexed by owner then size class
+    thread_local PendingFree* PendingFreesByThread[MAX_COLLECTED_THREADS];
+
+    ThreadHeap::ThreadHeap() :slabs(nullptr), new_outside(nullptr), outside(nullptr), allocated_bytes(0), sweep_cursor(nullptr), sweeping(false), sweep_lock(false)
+    {
+        for (int i = 0; i < SLAB_HEAP_CLASSES; ++i) {
+            free_list[i] = nullptr;
+            bump[i] = bump_end[i] = nullptr;
+            returned[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    void init_thread_heap(int thread)
+    {
+        if (HeapsByThread[thread] == nullptr) HeapsByThread[thread] = new ThreadHeap;
+    }
+
+    int64_t heap_allocated_bytes()
+    {
+        int64_t total = 0;
+        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+            if (HeapsByThread[i] != nullptr) total += HeapsByThread[i]->allocated_bytes.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    //counts a new collectable in its heap and charges it to this thread's allocation budget
+    static inline void count_allocation(ThreadHeap* h, size_t bytes)
+    {
+        h->allocated_bytes.store(h->allocated_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+        charge_allocation((int64_t)bytes);
+    }
+
+    void init_slab_arena()
+    {
+        SlabArenaBase = 0;
+        SlabArenaUsed = 0;
+        if (!UseSlabAllocator || SlabArenaBytes == 0) {
+            SlabArenaBytes = 0;
+            return;
+        }
+        SlabArenaBytes &= ~(SLAB_SIZE - 1);
+#ifdef _WIN32
+        //reservations are already aligned to 64k
+        void* base = VirtualAlloc(nullptr, SlabArenaBytes, MEM_RESERVE, PAGE_NOACCESS);
+        if (base == nullptr) {
+            SlabArenaBytes = 0;
+            return;
+        }
+        SlabArenaBase = (uintptr_t)base;
+#else
+        void* base = mmap(nullptr, SlabArenaBytes + SLAB_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            SlabArenaBytes = 0;
+            return;
+        }
+        SlabArenaBase = ((uintptr_t)base + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1);
+#endif
+    }
+
+    static char* arena_slab()
+    {
+        if (SlabArenaBytes == 0 || SlabArenaUsed.load(std::memory_order_relaxed) >= SlabArenaBytes) return nullptr;
+        size_t at = SlabArenaUsed.fetch_add(SLAB_SIZE);
+        if (at >= SlabArenaBytes) return nullptr;
+        char* mem = (char*)(SlabArenaBase + at);
+#ifdef _WIN32
+        if (VirtualAlloc(mem, SLAB_SIZE, MEM_COMMIT, PAGE_READWRITE) == nullptr) return nullptr;
+#else
+        if (mprotect(mem, SLAB_SIZE, PROT_READ | PROT_WRITE) != 0) return nullptr;
+#endif
+        return mem;
+    }
+
+    //collectable slabs have to be in the arena, their cells are found by address.  Returns false if there is no room.
+    static bool new_slab(ThreadHeap* h, int size_class)
+    {
+        bool collectables = size_class < SLAB_SIZE_CLASSES;
+        char* mem = arena_slab();
+        if (mem == nullptr) {
+            if (collectables) return false;
+            mem = (char*)::operator new(SLAB_SIZE, std::align_val_t(SLAB_SIZE));
+        }
+        SlabHeader* s = (SlabHeader*)mem;
+        s->owner = MyThreadNumber;
+        s->size_class = size_class;
+
+        size_t cell = slab_cell_size(size_class % SLAB_SIZE_CLASSES);
+        size_t cells = (SLAB_SIZE - sizeof(SlabHeader) - 64) / (cell + 1);
+        char* map = mem + sizeof(SlabHeader);
+        memset(map, 0, cells);
+        s->cell_count = (int)cells;
+        s->marks = (std::atomic<uint8_t>*)map;
+        s->cells = (char*)(((uintptr_t)map + cells + 63) & ~(uintptr_t)63);
+        s->cell_reciprocal = (uint32_t)(((uint64_t(1) << 32) + cell - 1) / cell);
+        s->next_slab = nullptr;
+        //the sweep walks the collectable slabs, so publish the slab only once it's set up
+        if (collectables) {
+            s->next_slab = h->slabs.load(std::memory_order_relaxed);
+            h->slabs.store(s, std::memory_order_release);
+        }
+
+        h->bump[size_class] = s->cells;
+        h->bump_end[size_class] = s->cells + cells * cell;
+        return true;
+    }
+
+    static SlabFreeCell* take_returned(ThreadHeap* h, int c)
+    {
+        if (h->returned[c].load(std::memory_order_relaxed) == nullptr) return nullptr;
+        return h->returned[c].exchange(nullptr, std::memory_order_acquire);
+    }
+
+    //null only for a collectable size class once the arena is used up
+    static void* heap_alloc(ThreadHeap* h, int c)
+    {
+        SlabFreeCell* cell = h->free_list[c];
+        if (cell == nullptr) cell = take_returned(h, c);
+        if (cell == nullptr && h->bump[c] == h->bump_end[c]) {
+            //sweeping a chunk of what the last collection left may hand cells back to this heap first
+            if (c < SLAB_SIZE_CLASSES && lazy_sweep_step()) cell = take_returned(h, c);
+            if (cell == nullptr && !new_slab(h, c)) return nullptr;
+        }
+        if (cell != nullptr) {
+            h->free_list[c] = cell->next;
+            return cell;
+        }
+        void* ret = h->bump[c];
+        h->bump[c] += slab_cell_size(c % SLAB_SIZE_CLASSES);
+        return ret;
+    }
+
+    void* slab_alloc(size_t s)
+    {
+        if (!UseSlabAllocator || s > SLAB_MAX_CELL) return ::operator new(s);
+        return heap_alloc(HeapsByThread[MyThreadNumber], SLAB_SIZE_CLASSES + slab_size_class(s));
+    }
+
+    void* collectable_alloc(size_t s)
+    {
+        ThreadHeap* h = HeapsByThread[MyThreadNumber];
+        if (SlabArenaBytes != 0 && s <= SLAB_MAX_CELL) {
+            void* p = heap_alloc(h, slab_size_class(s));
+            if (p != nullptr) {
+                slab_mark_byte(p)->store(MarkEpoch, std::memory_order_relaxed);
+                count_allocation(h, slab_cell_size(slab_size_class(s)));
+                return p;
+            }
+        }
+        OutsideHeader* o = (OutsideHeader*)::operator new(sizeof(OutsideHeader) + s);
+        o->mark.store(MarkEpoch, std::memory_order_relaxed);
+        o->granules = (uint32_t)((s + (size_t(1) << SLAB_GRANULE_BITS) - 1) >> SLAB_GRANULE_BITS);
+        count_allocation(h, size_t(o->granules) << SLAB_GRANULE_BITS);
+        OutsideHeader* old = h->new_outside.load(std::memory_order_relaxed);
+        do {
+            o->next = old;
+        } while (!h->new_outside.compare_exchange_weak(old, o, std::memory_order_release, std::memory_order_relaxed));
+        return o + 1;
+    }
+
+    static void push_returned(int owner, int size_class, PendingFree& p)
+    {
+        std::atomic<SlabFreeCell*>& r = HeapsByThread[owner]->returned[size_class];
+        SlabFreeCell* old = r.load(std::memory_order_relaxed);
+        do {
+            p.tail->next = old;
+        } while (!r.compare_exchange_weak(old, p.head, std::memory_order_release, std::memory_order_relaxed));
+        p.head = p.tail = nullptr;
+        p.count = 0;
+    }
+
+    //A slab cell goes straight back on its owner's returned list rather than into a batch, since this can run on a
+    //mutator that never flushes one.  An outside object waits in its list for the sweep, with a 0 mark so nothing
+    //destroys it.
+    void collectable_free(void* p)
+    {
+        collectable_mark_byte(p)->store(0, std::memory_order_relaxed);
+        if (!in_slab_arena(p)) return;
+        FreedBytes += collectable_bytes(p);
+        SlabHeader* slab = slab_of(p);
+        PendingFree one = { (SlabFreeCell*)p, (SlabFreeCell*)p, 1 };
+        push_returned(slab->owner, slab->size_class, one);
+    }
+
+    void slab_free(void* p, size_t s)
+    {
+        if (!UseSlabAllocator || s > SLAB_MAX_CELL) {
+            ::operator delete(p);
+            return;
+        }
+        slab_free_cell(p);
+    }
+
+    void slab_free_cell(void* p)
+    {
+        SlabHeader* slab = slab_of(p);
+        int owner = slab->owner;
+        int c = slab->size_class;
+        PendingFree*& pending = PendingFreesByThread[owner];
+        if (pending == nullptr) pending = new PendingFree[SLAB_HEAP_CLASSES]();
+
+        SlabFreeCell* cell = (SlabFreeCell*)p;
+        PendingFree& batch = pending[c];
+        cell->next = batch.head;
+        batch.head = cell;
+        if (batch.tail == nullptr) batch.tail = cell;
+        if (++batch.count >= SLAB_FREE_BATCH) push_returned(owner, c, batch);
+    }
+
+    void flush_freed_cells()
+    {
+        for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+            PendingFree* pending = PendingFreesByThread[i];
+            if (pending == nullptr) continue;
+            for (int c = 0; c < SLAB_HEAP_CLASSES; ++c) {
+                if (pending[c].count != 0) push_returned(i, c, pending[c]);
+            }
+        }
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include "GCState.h"
+#include <stddef.h>
+
+/*
+Per thread, size segregated slab allocator for collectables and root letters.
+
+Every thread slot (MyThreadNumber) owns a ThreadHeap.  A heap hands out cells from 64k slabs, each slab
+holding cells of a single size class, and collectables and root letters never share a slab.  The slab header
+records the owning slot and the size class, so finding the owner of a cell is just masking off the low bits of its
+address.
+
+Only the owning thread allocates from its heap, so the allocation path has no atomics in it.
+Cells are freed by whichever thread sweeps them, the collector or, with LazySweep, a thread taking a sweep chunk
+before it takes a new slab.  The sweeping thread gathers freed cells into batches per owner
+and per size class and pushes each batch onto the owner's returned list with a single CAS.  The owner takes the
+whole returned list with one exchange when its own free list runs dry.
+
+The heap is the only record of which collectables exist, objects carry no list links.  Slabs are carved out of one
+reserved range of address space (the slab arena) so that telling whether an object lives in a slab is a single
+compare.  Each collectable slab keeps one mark byte per cell right after its header: 0 for a free cell, otherwise
+the epoch the object was last marked in, or allocated in, since new objects start out marked.  The sweep walks
+each heap's slabs and frees every cell whose byte is neither 0 nor the current MarkEpoch.  After a sweep every
+byte is 0 or the current epoch, so the epoch can wrap around without the maps ever being wiped.
+
+Collectables bigger than SLAB_MAX_CELL, or allocated once the arena has run out, come from the system allocator
+with an OutsideHeader in front of them that holds their mark byte and links them into their heap's outside list.
+*/
+
+namespace GC {
+
+    const int SLAB_SIZE_BITS = 16;
+    const size_t SLAB_SIZE = size_t(1) << SLAB_SIZE_BITS;
+    //cells are multiples of 16 bytes so that SnapPtr members stay aligned
+    const int SLAB_GRANULE_BITS = 4;
+    const size_t SLAB_MAX_CELL = 512;
+    const int SLAB_SIZE_CLASSES = (int)(SLAB_MAX_CELL >> SLAB_GRANULE_BITS);
+    const int SLAB_FREE_BATCH = 64;
+    //a heap keeps the size classes of collectable slabs first, then those of root letter slabs
+    const int SLAB_HEAP_CLASSES = SLAB_SIZE_CLASSES * 2;
+
+    //the top bit of a mark byte is set for types registered with GC_NO_DESTRUCTOR, the rest is the epoch
+    const uint8_t MARK_EPOCH_BITS = 0x7f;
+    const uint8_t MARK_NO_DESTRUCTOR = 0x80;
+
+    struct SlabFreeCell
+    {
+        SlabFreeCell* next;
+    };
+
+    struct alignas(64) SlabHeader
+    {
+        int owner;
+        //index into the owner's heap, so root letter slabs count from SLAB_SIZE_CLASSES
+        int size_class;
+        int cell_count;
+        SlabHeader* next_slab;
+        char* cells;
+        //multiplying a cell's offset by this and shifting by 32 gives its index without a divide
+        uint32_t cell_reciprocal;
+        //one per cell, follows the header
+        std::atomic<uint8_t>* marks;
+    };
+
+    //in front of every collectable outside of the slab arena
+    struct alignas(16) OutsideHeader
+    {
+        OutsideHeader* next;
+        std::atomic<uint8_t> mark;
+        //the object's size in granules, for the pacer's count of live bytes
+        uint32_t granules;
+    };
+
+    struct ThreadHeap
+    {
+        //only touched by the owning thread
+        SlabFreeCell* free_list[SLAB_HEAP_CLASSES];
+        char* bump[SLAB_HEAP_CLASSES];
+        char* bump_end[SLAB_HEAP_CLASSES];
+        //collectable slabs, pushed by the owner, walked by the sweep
+        std::atomic<SlabHeader*> slabs;
+        //batches of cells freed by the collector, pushed by any thread, taken whole by the owner
+        std::atomic<SlabFreeCell*> returned[SLAB_HEAP_CLASSES];
+        //the owner pushes new outside objects here, the sweep takes them over into outside
+        std::atomic<OutsideHeader*> new_outside;
+        OutsideHeader* outside;
+        //bytes of collectables allocated from this heap since init, at their cell sizes.  Only the owner writes it,
+        //so it's a plain store and anyone can sum the heaps without stopping them.
+        std::atomic_int64_t allocated_bytes;
+
+        //what is left of the sweep after the last mark: the next slab, then the outside objects.  Only touched with
+        //sweep_lock held, sweeping can be read without it.
+        SlabHeader* sweep_cursor;
+        std::atomic_bool sweeping;
+        std::atomic_bool sweep_lock;
+
+        ThreadHeap();
+    };
+
+    extern ThreadHeap* HeapsByThread[MAX_COLLECTED_THREADS];
+    //bytes of collectables freed since init, by the sweep or by collectable_free
+    extern std::atomic_int64_t FreedBytes;
+    //the allocated_bytes of every heap added up
+    int64_t heap_allocated_bytes();
+
+    //set before GC::init, it can't be changed once anything has been allocated
+    extern bool UseSlabAllocator;
+    //address space to reserve for slabs, set before GC::init.  0 means every collectable comes from the system
+    //allocator with an OutsideHeader.
+    extern size_t SlabArenaBytes;
+    extern uintptr_t SlabArenaBase;
+
+    inline int slab_size_class(size_t s) { return (int)((s + ((size_t(1) << SLAB_GRANULE_BITS) - 1)) >> SLAB_GRANULE_BITS) - 1; }
+    inline size_t slab_cell_size(int size_class) { return size_t(size_class + 1) << SLAB_GRANULE_BITS; }
+    inline SlabHeader* slab_of(const void* p) { return (SlabHeader*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1)); }
+    inline bool in_slab_arena(const void* p) { return (uintptr_t)p - SlabArenaBase < SlabArenaBytes; }
+    inline std::atomic<uint8_t>* slab_mark_byte(const void* p)
+    {
+        SlabHeader* s = slab_of(p);
+        return &s->marks[((uint64_t)((const char*)p - s->cells) * s->cell_reciprocal) >> 32];
+    }
+    inline OutsideHeader* outside_header(const void* p) { return (OutsideHeader*)p - 1; }
+    //p has to be the address the collectable was allocated at, so Collectable has to be its first base
+    inline std::atomic<uint8_t>* collectable_mark_byte(const void* p)
+    {
+        if (in_slab_arena(p)) return slab_mark_byte(p);
+        return &outside_header(p)->mark;
+    }
+    //what a collectable takes up in its heap, counting the rounding up to a whole cell
+    inline size_t collectable_bytes(const void* p)
+    {
+        if (in_slab_arena(p)) return slab_cell_size(slab_of(p)->size_class);
+        return size_t(outside_header(p)->granules) << SLAB_GRANULE_BITS;
+    }
+
+    void init_slab_arena();
+    void init_thread_heap(int thread);
+    //for root letters and the other list nodes, they are never swept
+    void* slab_alloc(size_t s);
+    void slab_free(void* p, size_t s);
+    //for collectables, which come back already marked in the current epoch
+    void* collectable_alloc(size_t s);
+    //only for an object that never finished being constructed, the sweep frees everything else
+    void collectable_free(void* p);
+    //for a cell known to be in a slab, whatever its size class
+    void slab_free_cell(void* p);
+    //hands any partial batches this thread has gathered back to their owners
+    void flush_freed_cells();
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+/* Microsoft C/C++-compatible compiler */
+#include <intrin.h>
+#elif defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/*
+The double pointer that every InstancePtr and root holds.  The first half is the live pointer that the program
+sees, the second half is the snapshot that the collector traces.
+
+Outside of a collection both halves are written together with one aligned 16 byte store.  While collecting only
+the live half is written, and afterwards the collector copies live over snapshot, with a 16 byte compare exchange
+when mutators might be storing to the same pointer.
+
+MSVC gets these from __m128i and _InterlockedCompareExchange128.  GCC and Clang on x86-64 use SSE loads and stores
+and lock cmpxchg16b in inline asm, so nothing goes through libatomic.  Other 64 bit targets fall back on the
+__atomic builtins for 128 bit values (link with -latomic).
+*/
+
+namespace GC {
+
+#if defined(_MSC_VER)
+    typedef __m128i SnapPtr;
+
+    inline uint64_t& snap_live(SnapPtr& s) { return s.m128i_u64[0]; }
+    inline uint64_t& snap_snapshot(SnapPtr& s) { return s.m128i_u64[1]; }
+    inline uint64_t snap_live(const SnapPtr& s) { return s.m128i_u64[0]; }
+    inline uint64_t snap_snapshot(const SnapPtr& s) { return s.m128i_u64[1]; }
+#else
+    struct alignas(16) SnapPtr
+    {
+        uint64_t live;
+        uint64_t snapshot;
+    };
+
+    inline uint64_t& snap_live(SnapPtr& s) { return s.live; }
+    inline uint64_t& snap_snapshot(SnapPtr& s) { return s.snapshot; }
+    inline uint64_t snap_live(const SnapPtr& s) { return s.live; }
+    inline uint64_t snap_snapshot(const SnapPtr& s) { return s.snapshot; }
+#endif
+
+    //both halves in one aligned 16 byte store, no fence
+    inline void double_ptr_store(SnapPtr* dest, void* v)
+    {
+#if defined(_MSC_VER) || defined(__x86_64__)
+        _mm_store_si128((__m128i*)dest, _mm_set1_epi64x((int64_t)v));
+#else
+        unsigned __int128 both = ((unsigned __int128)(uint64_t)v << 64) | (uint64_t)v;
+        __atomic_store_n((unsigned __int128*)dest, both, __ATOMIC_RELAXED);
+#endif
+    }
+
+    //both halves in one aligned 16 byte load, no fence
+    inline SnapPtr double_ptr_load(const SnapPtr* source)
+    {
+#if defined(_MSC_VER)
+        return _mm_load_si128(source);
+#elif defined(__x86_64__)
+        SnapPtr ret;
+        _mm_store_si128((__m128i*)&ret, _mm_load_si128((const __m128i*)source));
+        return ret;
+#else
+        unsigned __int128 both = __atomic_load_n((unsigned __int128*)source, __ATOMIC_RELAXED);
+        SnapPtr ret;
+        ret.live = (uint64_t)both;
+        ret.snapshot = (uint64_t)(both >> 64);
+        return ret;
+#endif
+    }
+
+    //on failure expected gets what was there
+    inline bool double_ptr_CAS(SnapPtr* dest, SnapPtr* expected, SnapPtr src)
+    {
+#if defined(_MSC_VER)
+        return _InterlockedCompareExchange128(&dest->m128i_i64[0], src.m128i_i64[1], src.m128i_i64[0], &expected->m128i_i64[0]);
+#elif defined(__x86_64__)
+        bool ok;
+        __asm__ __volatile__("lock cmpxchg16b %1"
+            : "=@ccz"(ok), "+m"(*dest), "+a"(expected->live), "+d"(expected->snapshot)
+            : "b"(src.live), "c"(src.snapshot)
+            : "memory");
+        return ok;
+#else
+        return __atomic_compare_exchange((unsigned __int128*)dest, (unsigned __int128*)expected, (unsigned __int128*)&src,
+            false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+    }
+
+    inline void single_ptr_store(SnapPtr* dest, void* v)
+    {
+        snap_live(*dest) = (uint64_t)v;
+    }
+    inline void* load(const SnapPtr* dest)
+    {
+        return (void*)snap_live(*dest);
+    }
+    inline void* load_snapshot(const SnapPtr* dest)
+    {
+        return (void*)snap_snapshot(*dest);
+    }
+    inline SnapPtr double_ptr_swap(SnapPtr* dest, SnapPtr src)
+    {
+        SnapPtr cmp = double_ptr_load(dest);
+        while (!double_ptr_CAS(dest, &cmp, src));
+        return cmp;
+    }
+    //for when no mutator can be storing to both halves
+    inline void fast_restore(SnapPtr* source)
+    {
+        if (source == nullptr) return;
+        SnapPtr temp = double_ptr_load(source);
+        if (snap_live(temp) != snap_snapshot(temp)) snap_snapshot(*source) = snap_live(temp);
+
+    }
+    inline void restore(SnapPtr* source)
+    {
+        if (source == nullptr) return;
+        SnapPtr temp = double_ptr_load(source);
+        SnapPtr to;
+        do {
+            if (snap_live(temp) == snap_snapshot(temp)) {
+                return;
+            }
+            snap_live(to) = snap_snapshot(to) = snap_live(temp);
+        } while (!double_ptr_CAS(source, &temp, to));
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+//A fixed size Chase-Lev deque.  The owning thread pushes and pops at the bottom, any other thread can steal from the top.
+//push fails instead of growing when the deque is full, the caller is expected to do the work itself in that case.
+template<typename T, int MAX_LEN>
+struct WorkStealingDeque
+{
+    static_assert((MAX_LEN& (MAX_LEN - 1)) == 0, "WorkStealingDeque length has to be a power of 2");
+
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<T> items[MAX_LEN];
+
+    WorkStealingDeque() :top(0), bottom(0) {}
+
+    int64_t size() const
+    {
+        return bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+    }
+
+    //owner only
+    bool push(T v)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= MAX_LEN) return false;
+        items[b & (MAX_LEN - 1)].store(v, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    //owner only, returns false when empty
+    bool pop(T& v)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        v = items[b & (MAX_LEN - 1)].load(std::memory_order_relaxed);
+        if (t == b) {
+            //last item, race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    //any thread, returns false when empty or when it lost a race
+    bool steal(T& v)
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return false;
+        v = items[t & (MAX_LEN - 1)].load(std::memory_order_relaxed);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,45 @@
+// alloc_bench : throughput of the demo's mutator_thread with the slab allocator versus the system allocator.
+//
+// usage: alloc_bench [slab|system] [iterations]
+// The allocator can't be switched once anything has been allocated, so with no mode given
+// the program runs itself once for each allocator.
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+
+#include "../DemoWorkload.h"
+
+static void run(bool slab, int iterations)
+{
+    GC::UseSlabAllocator = slab;
+    GC::init();
+
+    auto start = std::chrono::steady_clock::now();
+    mutator_thread(iterations);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    GC::exit_collect_thread();
+    std::cout << (slab ? "slab" : "system") << " allocator: " << iterations << " iterations in " << elapsed.count() << "s, "
+        << iterations / elapsed.count() << " iterations/s\n";
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 10;
+    if (argc > 2) iterations = atoi(argv[2]);
+    if (argc > 1) {
+        std::string mode = argv[1];
+        if (mode != "slab" && mode != "system") {
+            std::cerr << "usage: " << argv[0] << " [slab|system] [iterations]\n";
+            return 1;
+        }
+        run(mode == "slab", iterations);
+        return 0;
+    }
+    std::string self = std::string("\"") + argv[0] + "\"";
+    int r = std::system((self + " system " + std::to_string(iterations)).c_str());
+    if (r == 0) r = std::system((self + " slab " + std::to_string(iterations)).c_str());
+    return r == 0 ? 0 : 1;
+}
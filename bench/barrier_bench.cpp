@@ -0,0 +1,60 @@
+// barrier_bench : InstancePtr store throughput with the inlined write barrier versus the old call through a
+// thread_local function pointer.
+//
+// usage: barrier_bench [iterations]
+// Both run outside of a collection, where the barrier stores both halves of the pointer.  The old barrier is
+// rebuilt here the way it was, a thread_local pointer that SetThreadState used to point at a regular function.
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "../DemoWorkload.h"
+
+const int SLOTS = 1024;
+
+static thread_local void (*OldWriteBarrier)(GC::SnapPtr*, void*);
+static void old_regular_write_barrier(GC::SnapPtr* dest, void* v)
+{
+    GC::double_ptr_store(dest, v);
+}
+
+template<typename F>
+static double time_stores(int iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; ++n) {
+        for (int i = 0; i < SLOTS; ++i) f(i, n);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / ((double)iterations * SLOTS);
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 50000;
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations < 1) {
+        std::cerr << "usage: " << argv[0] << " [iterations]\n";
+        return 1;
+    }
+    GC::init(true);
+    OldWriteBarrier = old_regular_write_barrier;
+    {
+        RootPtr<CollectableVector<RandomCounted> > targets = cnew(CollectableVector<RandomCounted>(SLOTS));
+        for (int i = 0; i < SLOTS; ++i) targets->push_back(cnew(RandomCounted(i)));
+        InstancePtr<RandomCounted>* slots = new InstancePtr<RandomCounted>[SLOTS];
+        RandomCounted** t = new RandomCounted * [SLOTS];
+        for (int i = 0; i < SLOTS; ++i) t[i] = targets[i].get();
+
+        double old_ns = time_stores(iterations, [&](int i, int n) { OldWriteBarrier(&slots[i].value, t[(i + n) & (SLOTS - 1)]); });
+        double inline_ns = time_stores(iterations, [&](int i, int n) { slots[i] = t[(i + n) & (SLOTS - 1)]; });
+
+        std::cout << "thread_local function pointer barrier: " << old_ns << " ns per store\n";
+        std::cout << "inlined phase checked barrier: " << inline_ns << " ns per store\n";
+        delete[] slots;
+        delete[] t;
+    }
+    GC::exit_collect_thread();
+    return 0;
+}
@@ -0,0 +1,55 @@
+// bench_util : what the multi-threaded benches share.  Their mutators count themselves in Started and wait for Go
+// before the timed part starts, run until Stop and add their ops to Ops.  With no thread count given a bench runs
+// itself once per configuration, so that every line's peak RSS is from a fresh process.
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+static std::atomic_bool Go;
+static std::atomic_bool Stop;
+static std::atomic_int Started;
+static std::atomic<int64_t> Ops;
+
+static double peak_rss_mb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS c;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &c, sizeof(c))) return 0;
+    return c.PeakWorkingSetSize / 1048576.0;
+#else
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+#ifdef __APPLE__
+    return r.ru_maxrss / 1048576.0;
+#else
+    return r.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+//runs "self name threads seconds" for each name at 1, 2, 4... up to most threads.  False if a run failed.
+static bool run_each_in_own_process(const char* self, const std::vector<std::string>& names, int most, double seconds)
+{
+    std::string quoted = std::string("\"") + self + "\"";
+    for (auto& name : names) {
+        for (int t = 1; t <= most; t *= 2) {
+            std::string cmd = quoted + " " + name + " " + std::to_string(t) + " " + std::to_string(seconds);
+            if (std::system(cmd.c_str()) != 0) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,325 @@
+// gc_bench : allocation throughput, collection cycle time, peak RSS and minimum mutator utilization for a few
+// workloads, at increasing numbers of mutator threads.
+//
+// usage: gc_bench [binary_trees|random_graph|lru_cache|vector_growth|all] [threads] [seconds]
+// The collector runs on its own thread, paced by the allocation budget, while each mutator thread runs the workload
+// on data of its own for the given time.
+//   binary_trees   builds and drops depth 10 trees next to a long lived one, an op is a tree
+//   random_graph   relinks and replaces the nodes of a RandomCounted graph like mutator_thread does, an op is a change
+//   lru_cache      looks keys up in a CollectableHashTable kept to a fixed size by evicting the least recently used
+//                  entry, so the table churns through erased entries, an op is a lookup
+//   vector_growth  push_backs onto a CollectableVector until it has 100000 elements then starts a new one, an op is
+//                  a push_back
+// Minimum mutator utilization for a window is the smallest fraction of any window that long, anywhere in the run,
+// that a mutator had to itself.  It's worked out from the trace: every handshake wait and every chunk of lazy
+// sweeping a mutator did is time taken away from it, and the worst mutator is reported.  Time the scheduler gives
+// to other threads isn't counted, so with more threads than cores it only shows what the collector itself costs.
+// With no thread count the program runs itself once per workload for 1, 2, 4... threads up to the number of cores
+// (at least 4), so that every line's peak RSS is from a fresh process.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+
+#include "../DemoWorkload.h"
+#include "bench_util.h"
+
+struct TreeNode : public Collectable
+{
+    InstancePtr<TreeNode> left;
+    InstancePtr<TreeNode> right;
+    GC_TRACE_FIELDS(left, right)
+    size_t my_size() const { return sizeof(*this); }
+};
+
+GC_NO_DESTRUCTOR(TreeNode)
+
+//what the tree walks counted, kept so they aren't optimized away
+static std::atomic<int64_t> Found;
+
+static std::mutex CycleLock;
+static std::vector<double> CycleMs;
+
+static void note_cycle(const GC::Stats& s)
+{
+    std::lock_guard<std::mutex> lock(CycleLock);
+    CycleMs.push_back((s.end - s.start) / 1e6);
+}
+
+//after its setup, a mutator waits here until every one of them is ready
+static void ready()
+{
+    ++Started;
+    while (!Go) {
+        GC::safe_point();
+        std::this_thread::yield();
+    }
+}
+
+static RootPtr<TreeNode> bottom_up_tree(int depth)
+{
+    GC::safe_point();
+    RootPtr<TreeNode> n = cnew(TreeNode);
+    if (depth > 0) {
+        n->left = bottom_up_tree(depth - 1);
+        n->right = bottom_up_tree(depth - 1);
+    }
+    return n;
+}
+
+static int64_t check_tree(TreeNode* n)
+{
+    if (n->left.get() == nullptr) return 1;
+    return 1 + check_tree(n->left.get()) + check_tree(n->right.get());
+}
+
+static void binary_trees()
+{
+    GC::ThreadRAII gc_thread;
+    int64_t n = 0;
+    int64_t found = 0;
+    {
+        RootPtr<TreeNode> long_lived = bottom_up_tree(14);
+        ready();
+        while (!Stop) {
+            RootPtr<TreeNode> t = bottom_up_tree(10);
+            int64_t nodes = check_tree(t.get());
+            assert(nodes == 2047);
+            found += nodes;
+            ++n;
+        }
+        int64_t nodes = check_tree(long_lived.get());
+        assert(nodes == 32767);
+        found += nodes;
+    }
+    Ops += n;
+    Found += found;
+}
+
+static void random_graph()
+{
+    const int NODES = 20000;
+    GC::ThreadRAII gc_thread;
+    int64_t n = 0;
+    {
+        std::vector<RootPtr<RandomCounted> > nodes(NODES);
+        std::default_random_engine generator(Started.load());
+        std::uniform_int_distribution<int> distribution(0, NODES - 1);
+        for (int i = 0; i < NODES; ++i) nodes[i] = cnew(RandomCounted(i));
+        ready();
+        while (!Stop) {
+            GC::safe_point();
+            int i = distribution(generator);
+            int j = distribution(generator);
+            switch (n & 3) {
+            case 0: nodes[i] = cnew(RandomCounted(i)); break;
+            case 1: nodes[i]->set_first(nodes[j], nodes[j]); break;
+            default: nodes[i]->set_second(nodes[j], nodes[j]); break;
+            }
+            ++n;
+        }
+    }
+    Ops += n;
+}
+
+static void lru_cache()
+{
+    const int ENTRIES = 10000;
+    const int KEYS = 4 * ENTRIES;
+    GC::ThreadRAII gc_thread;
+    int64_t n = 0;
+    {
+        RootPtr<CollectableHashTable<CollectableString, RandomCounted> > table = cnew2template(CollectableHashTable<CollectableString, RandomCounted>());
+        //the most recent key first
+        std::list<int> recency;
+        std::unordered_map<int, std::list<int>::iterator> where;
+        std::default_random_engine generator(Started.load());
+        std::uniform_int_distribution<int> distribution(0, KEYS - 1);
+        ready();
+        while (!Stop) {
+            //half the lookups go to a hot eighth of the keys
+            int k = distribution(generator);
+            if (k & 1) k >>= 3;
+            RootPtr<CollectableString> key = int_to_string(k);
+            auto found = where.find(k);
+            if (found != where.end()) {
+                RootPtr<RandomCounted> v = table[key];
+                assert(v->identity == k);
+                (void)v;
+                recency.splice(recency.begin(), recency, found->second);
+            }
+            else {
+                table->insert(key, cnew(RandomCounted(k)));
+                recency.push_front(k);
+                where[k] = recency.begin();
+                if ((int)recency.size() > ENTRIES) {
+                    int old = recency.back();
+                    recency.pop_back();
+                    where.erase(old);
+                    bool erased = table->erase(int_to_string(old));
+                    assert(erased);
+                    (void)erased;
+                }
+            }
+            ++n;
+        }
+        assert(table->size() == (int)recency.size());
+    }
+    Ops += n;
+}
+
+static void vector_growth()
+{
+    const int LENGTH = 100000;
+    GC::ThreadRAII gc_thread;
+    int64_t n = 0;
+    {
+        RootPtr<CollectableVector<RandomCounted> > vec = cnew(CollectableVector<RandomCounted>());
+        ready();
+        while (!Stop) {
+            GC::safe_point();
+            if (vec->size() == LENGTH) vec = cnew(CollectableVector<RandomCounted>());
+            vec->push_back(cnew(RandomCounted((int)n)));
+            ++n;
+        }
+    }
+    Ops += n;
+}
+
+struct Workload
+{
+    const char* name;
+    void (*mutator)();
+};
+
+static const Workload Workloads[] = {
+    { "binary_trees", binary_trees },
+    { "random_graph", random_graph },
+    { "lru_cache", lru_cache },
+    { "vector_growth", vector_growth },
+};
+
+typedef std::vector<std::pair<int64_t, int64_t> > Pauses;
+
+//the smallest fraction of any window of that length within [from, to] that isn't covered by pauses, which are
+//sorted and don't overlap.  The worst window always starts where a pause starts or ends where one ends.
+static double mmu(const Pauses& pauses, int64_t from, int64_t to, int64_t window)
+{
+    if (to - from < window) return -1;
+    //paused[i] is the pause time before pauses[i] starts
+    std::vector<int64_t> paused(pauses.size() + 1, 0);
+    for (size_t i = 0; i < pauses.size(); ++i) paused[i + 1] = paused[i] + pauses[i].second - pauses[i].first;
+    auto paused_before = [&](int64_t t) {
+        size_t i = std::upper_bound(pauses.begin(), pauses.end(), std::make_pair(t, INT64_MAX)) - pauses.begin();
+        if (i == 0) return (int64_t)0;
+        int64_t p = paused[i - 1];
+        return p + std::min(t, pauses[i - 1].second) - pauses[i - 1].first;
+    };
+    int64_t worst = 0;
+    auto check = [&](int64_t start) {
+        start = std::max(from, std::min(start, to - window));
+        worst = std::max(worst, paused_before(start + window) - paused_before(start));
+    };
+    for (auto& p : pauses) {
+        check(p.first);
+        check(p.second - window);
+    }
+    return 1.0 - (double)worst / window;
+}
+
+static void run(const Workload& w, int threads, double seconds)
+{
+    GC::TraceEvents = true;
+    //the mutators have exited by the time MMU is worked out, and it needs every pause of the run
+    GC::TraceChunksPerThread = 256;
+    GC::TraceExitedThreads = GC::MAX_COLLECTED_THREADS;
+    //a smaller floor on the heap than the default, so that even the slowest allocating workload collects in a short run
+    GC::MinHeapBytes = 16 * 1024 * 1024;
+    GC::StatsCallback = note_cycle;
+    GC::init();
+    std::vector<std::thread> mutators;
+    for (int i = 0; i < threads; ++i) mutators.emplace_back(w.mutator);
+    while (Started < threads) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    int64_t from = GC::trace_clock();
+    int64_t allocated = GC::allocated_bytes();
+    Go = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    int64_t to = GC::trace_clock();
+    allocated = GC::allocated_bytes() - allocated;
+    Stop = true;
+    for (auto& t : mutators) t.join();
+    double elapsed = (to - from) / 1e9;
+
+    //every mutator's pauses inside the run, merged where they overlap
+    std::map<int, Pauses> by_thread;
+    GC::for_each_trace_event([&](int tid, const char* thread, const GC::TraceEvent& e) {
+        if (strncmp(thread, "mutator", 7) != 0) return;
+        Pauses& p = by_thread[tid];
+        int64_t start = std::max(e.start, from), end = std::min(e.end, to);
+        if (start < end) p.push_back(std::make_pair(start, end));
+    });
+    for (auto& t : by_thread) {
+        Pauses& p = t.second;
+        std::sort(p.begin(), p.end());
+        size_t n = 0;
+        for (size_t i = 0; i < p.size(); ++i) {
+            if (n > 0 && p[i].first <= p[n - 1].second) p[n - 1].second = std::max(p[n - 1].second, p[i].second);
+            else p[n++] = p[i];
+        }
+        p.resize(n);
+    }
+
+    std::vector<double> cycles;
+    {
+        std::lock_guard<std::mutex> lock(CycleLock);
+        cycles = CycleMs;
+    }
+    std::sort(cycles.begin(), cycles.end());
+
+    std::cout << std::fixed << std::setprecision(1) << w.name << ", " << threads << (threads == 1 ? " thread: " : " threads: ")
+        << Ops / elapsed << " ops/s, " << allocated / elapsed / 1048576.0 << " MB/s allocated, "
+        << cycles.size() << " collections";
+    if (!cycles.empty()) std::cout << " (median " << cycles[cycles.size() / 2] << " ms, max " << cycles.back() << " ms)";
+    std::cout << ", peak RSS " << peak_rss_mb() << " MB\n  MMU";
+    std::cout << std::setprecision(3);
+    for (int64_t ms : { 1, 3, 10, 30, 100, 300, 1000 }) {
+        double worst = 1;
+        for (auto& t : by_thread) worst = std::min(worst, mmu(t.second, from, to, ms * 1000000));
+        std::cout << " " << ms << "ms:";
+        if (worst < 0) std::cout << "-";
+        else std::cout << worst;
+    }
+    std::cout << "\n";
+    GC::exit_collect_thread();
+}
+
+int main(int argc, char** argv)
+{
+    std::string name = argc > 1 ? argv[1] : "all";
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+    double seconds = argc > 3 ? atof(argv[3]) : 2;
+    const Workload* workload = nullptr;
+    for (auto& w : Workloads) if (name == w.name) workload = &w;
+    if ((workload == nullptr && name != "all") || threads < 0 || threads > GC::MAX_COLLECTED_THREADS - 2 || seconds <= 0) {
+        std::cerr << "usage: " << argv[0] << " [binary_trees|random_graph|lru_cache|vector_growth|all] [threads] [seconds]\n";
+        return 1;
+    }
+    if (workload != nullptr && threads > 0) {
+        run(*workload, threads, seconds);
+        return 0;
+    }
+    int most = std::max(4u, std::thread::hardware_concurrency());
+    std::vector<std::string> names;
+    for (auto& w : Workloads) if (workload == nullptr || workload == &w) names.push_back(w.name);
+    if (!run_each_in_own_process(argv[0], names, most, seconds)) return 1;
+    return 0;
+}
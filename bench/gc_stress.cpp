@@ -0,0 +1,223 @@
+// gc_stress : many mutators sharing one graph while threads come and go, checking every object they touch.
+//
+// usage: gc_stress [mutators] [seconds] [slab|malloc]
+// The mutators share a vector of SHARED_NODES slots.  They walk links from random slots, relink nodes to each other
+// (cycles and all), put new nodes in slots and hold some nodes in RootPtrs of their own, moving them about and
+// storing into the ones they moved from.  Now and then one leaves mutation for a moment while it still holds its
+// roots.  Each mutator exits after a random number of ops, whatever phase the collector is in, and the main thread
+// starts another in its place, so threads register and exit in the middle of collections the whole time.
+// Every node reached is checked before it's used:
+//   memtest (debug builds) asserts the node hasn't been swept, the sweep poisons deleted in every object it frees
+//   the node's canary has to match its id, and the destructor overwrites it, so a node used after its destructor
+//   ran is caught in release builds too
+// Once a second the main thread enters mutation, checks the whole graph and prints the throughput.  With malloc,
+// every object comes from the system allocator instead of the slabs, so that AddressSanitizer sees a freed object
+// that gets used even after its memory is handed out again.
+// A failed check prints what was wrong and aborts.  The program returns 0 if it ran the whole time.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "../DemoWorkload.h"
+
+const int SHARED_NODES = 10000;
+const int HELD = 16;
+const int WALK = 8;
+const uint64_t DEAD_CANARY = 0xdeaddeaddeaddeadull;
+
+static uint64_t canary_of(int64_t id)
+{
+    return (uint64_t)id * 0x9e3779b97f4a7c15ull ^ 0x5bd1e9955bd1e995ull;
+}
+
+struct StressNode : public Collectable
+{
+    InstancePtr<StressNode> first;
+    InstancePtr<StressNode> second;
+    int64_t id;
+    uint64_t canary;
+    StressNode(int64_t i) :id(i), canary(canary_of(i)) {}
+    ~StressNode() { canary = DEAD_CANARY; }
+    GC_TRACE_FIELDS(first, second)
+    size_t my_size() const { return sizeof(*this); }
+};
+
+static CollectableVector<StressNode>* Shared;
+static std::atomic<int64_t> NextId;
+static std::atomic<int64_t> Ops;
+static std::atomic<int64_t> ThreadsStarted;
+static std::atomic_bool Stop;
+
+static void check(const StressNode* n, const char* where)
+{
+#ifndef NDEBUG
+    n->memtest();
+#endif
+    if (n->canary == canary_of(n->id)) return;
+    std::cerr << "gc_stress: " << (n->canary == DEAD_CANARY ? "destroyed" : "corrupt") << " node " << n->id
+        << " at " << (const void*)n << " reached " << where << "\n";
+    std::abort();
+}
+
+static StressNode* shared_node(int i)
+{
+    StressNode* n = (*Shared)[i].get();
+    check(n, "from a shared slot");
+    return n;
+}
+
+struct Mutator
+{
+    std::thread thread;
+    std::atomic_bool done;
+};
+
+static void mutator(Mutator* self, uint64_t seed, int64_t ops)
+{
+    GC::ThreadRAII gc_thread;
+    ++ThreadsStarted;
+    std::default_random_engine generator((unsigned)seed);
+    std::uniform_int_distribution<int> slot(0, SHARED_NODES - 1);
+    int64_t n = 0;
+    {
+        std::vector<RootPtr<StressNode> > held(HELD);
+        for (; n < ops && !Stop; ++n) {
+            GC::safe_point();
+            uint32_t r = (uint32_t)generator();
+            int i = slot(generator);
+            int j = slot(generator);
+            int kind = r % 100;
+            if (kind < 60) {
+                StressNode* p = shared_node(i);
+                for (int k = 0; k < WALK && p != nullptr; ++k) {
+                    check(p, "by a walk");
+                    p = (r >> (8 + k)) & 1 ? p->second.get() : p->first.get();
+                }
+            }
+            else if (kind < 80) {
+                if (r & 256) shared_node(i)->second = shared_node(j);
+                else shared_node(i)->first = shared_node(j);
+            }
+            else if (kind < 90) {
+                StressNode* fresh = cnew(StressNode(NextId++));
+                fresh->first = shared_node(j);
+                fresh->second = held[r % HELD].get();
+                (*Shared)[i] = fresh;
+            }
+            else if (kind < 97) held[r % HELD] = shared_node(i);
+            else if (kind == 97) {
+                //a moved from RootPtr has to take a store and be a root again
+                RootPtr<StressNode> taken(std::move(held[r % HELD]));
+                held[r % HELD] = shared_node(i);
+                check(held[r % HELD].get(), "through a RootPtr stored into after a move");
+                if (taken.get() != nullptr) check(taken.get(), "through a RootPtr moved from another");
+            }
+            else if (kind == 98) {
+                for (auto& h : held) if (h.get() != nullptr) check(h.get(), "through a RootPtr");
+            }
+            else if ((r & 0xf00) == 0) {
+                {
+                    //roots stay good while the thread is out of mutation and the collector runs without it
+                    GC::LeaveMutationRAII away;
+                    if (r & 0x1000) std::this_thread::sleep_for(std::chrono::microseconds(r % 200));
+                    else std::this_thread::yield();
+                }
+                for (auto& h : held) if (h.get() != nullptr) check(h.get(), "through a RootPtr after leaving mutation");
+            }
+        }
+    }
+    Ops += n;
+    self->done = true;
+}
+
+//every slot and both links of every node in one, run as a mutator
+static void check_graph()
+{
+    for (int i = 0; i < SHARED_NODES; ++i) {
+        StressNode* n = shared_node(i);
+        if (n->first.get() != nullptr) check(n->first.get(), "from a node in the graph check");
+        if (n->second.get() != nullptr) check(n->second.get(), "from a node in the graph check");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int mutators = argc > 1 ? atoi(argv[1]) : 8;
+    double seconds = argc > 2 ? atof(argv[2]) : 10;
+    std::string heap = argc > 3 ? argv[3] : "slab";
+    if (mutators < 1 || mutators > GC::MAX_COLLECTED_THREADS - 2 || seconds <= 0 || (heap != "slab" && heap != "malloc")) {
+        std::cerr << "usage: " << argv[0] << " [mutators] [seconds] [slab|malloc]\n";
+        return 1;
+    }
+    if (heap == "malloc") GC::SlabArenaBytes = 0;
+    //collect often, it's the collections that are being tested
+    GC::MinHeapBytes = 4 * 1024 * 1024;
+    GC::init();
+    GC::init_thread();
+    {
+        RootPtr<CollectableVector<StressNode> > shared = cnew(CollectableVector<StressNode>(SHARED_NODES));
+        for (int i = 0; i < SHARED_NODES; ++i) shared->push_back(cnew(StressNode(NextId++)));
+        Shared = shared.get();
+        std::default_random_engine generator;
+        std::uniform_int_distribution<int> slot(0, SHARED_NODES - 1);
+        for (int i = 0; i < SHARED_NODES; ++i) {
+            shared[i]->first = shared[slot(generator)];
+            shared[i]->second = shared[slot(generator)];
+        }
+
+        std::vector<std::unique_ptr<Mutator> > running;
+        uint64_t seed = 0;
+        std::uniform_int_distribution<int> lifetime(1000, 200000);
+        auto start = std::chrono::steady_clock::now();
+        auto last = start;
+        int64_t last_ops = 0;
+        for (;;) {
+            {
+                GC::LeaveMutationRAII away;
+                for (auto& m : running) {
+                    if (!m->done) continue;
+                    m->thread.join();
+                    m.reset();
+                }
+                running.erase(std::remove(running.begin(), running.end(), nullptr), running.end());
+                while ((int)running.size() < mutators) {
+                    running.emplace_back(new Mutator());
+                    running.back()->done = false;
+                    running.back()->thread = std::thread(mutator, running.back().get(), ++seed, lifetime(generator));
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - last < std::chrono::seconds(1) && now - start < std::chrono::duration<double>(seconds)) continue;
+            check_graph();
+            //exited threads add their ops in, the ones still running count from the next report on
+            int64_t ops = Ops;
+            std::chrono::duration<double> since = now - last;
+            std::chrono::duration<double> total = now - start;
+            std::cout << std::fixed << std::setprecision(1) << total.count() << " s: " << (ops - last_ops) / since.count()
+                << " ops/s, " << ThreadsStarted << " threads started, " << GC::last_stats_cycle() << " collections, "
+                << GC::heap_bytes() / 1048576.0 << " MB in the heap, graph checked" << std::endl;
+            last = now;
+            last_ops = ops;
+            if (total.count() >= seconds) break;
+        }
+        Stop = true;
+        {
+            GC::LeaveMutationRAII away;
+            for (auto& m : running) m->thread.join();
+        }
+        check_graph();
+        std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+        std::cout << "passed: " << Ops << " ops in " << total.count() << " s (" << Ops / total.count() << " ops/s), "
+            << ThreadsStarted << " threads started, " << GC::last_stats_cycle() << " collections\n";
+    }
+    GC::exit_thread();
+    GC::exit_collect_thread();
+    return 0;
+}
@@ -0,0 +1,98 @@
+// handshake_bench : how long the phase handshakes of a collection take with more mutator threads than cores.
+//
+// usage: handshake_bench [futex|yield] [oversubscription] [collections]
+// The heap is almost empty, so the time of a collection is nearly all spent waiting for every mutator to reach a
+// safe point in each of the three phase changes.  The mutators just do busy work between safe points, the work
+// they get done shows how much cpu the waiting threads take away from them.
+// The mutators' own waits in each handshake come from their safepoint histograms.
+// With no mode given the program runs itself for both modes at 1x, 2x and 4x as many mutators as cores.
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "../DemoWorkload.h"
+
+static std::atomic_bool Stop;
+static std::atomic<int64_t> WorkDone;
+
+static void busy_mutator()
+{
+    GC::ThreadRAII gc_thread;
+    int64_t n = 0;
+    volatile uint64_t x = 0;
+    while (!Stop) {
+        for (int i = 0; i < 1000; ++i) x = x * 31 + i;
+        ++n;
+        GC::safe_point();
+    }
+    WorkDone += n;
+}
+
+static void run(bool park, int oversubscription, int collections)
+{
+    GC::ParkHandshakes = park;
+    GC::init(true);
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    int mutators = cores * oversubscription;
+    {
+        //this thread runs the collections, it never has to answer a handshake itself
+        std::vector<std::thread> threads;
+        for (int i = 0; i < mutators; ++i) threads.emplace_back(busy_mutator);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        std::vector<double> times;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < collections; ++i) {
+            auto t = std::chrono::steady_clock::now();
+            GC::one_collect();
+            times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t).count());
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        Stop = true;
+        for (auto& t : threads) t.join();
+
+        std::sort(times.begin(), times.end());
+        std::cerr << (park ? "futex" : "yield") << ", " << mutators << " mutators on " << cores << " cores: median "
+            << times[times.size() / 2] << " us, max " << times.back() << " us per collection, "
+            << WorkDone / elapsed.count() << " mutator work units/s\n";
+        //what the mutators waited in safe_point, from every thread that has exited
+        const char* names[GC::HANDSHAKE_KINDS] = { "start", "restore", "finalize" };
+        GC::LatencyHistogram h;
+        for (int k = 0; k < GC::HANDSHAKE_KINDS; ++k) {
+            GC::handshake_histogram(-1, (GC::Handshake)k, h);
+            std::cerr << "  mutator " << names[k] << " handshake: " << h.total << " waits, p50 " << h.percentile(0.5) / 1000.0
+                << " us, p99 " << h.percentile(0.99) / 1000.0 << " us, p99.9 " << h.percentile(0.999) / 1000.0 << " us, max " << h.highest / 1000.0 << " us\n";
+        }
+    }
+    GC::exit_collect_thread();
+}
+
+int main(int argc, char** argv)
+{
+    int oversubscription = 1;
+    int collections = 200;
+    if (argc > 2) oversubscription = atoi(argv[2]);
+    if (argc > 3) collections = atoi(argv[3]);
+    if (argc > 1) {
+        std::string mode = argv[1];
+        if ((mode != "futex" && mode != "yield") || oversubscription < 1 || collections < 1) {
+            std::cerr << "usage: " << argv[0] << " [futex|yield] [oversubscription] [collections]\n";
+            return 1;
+        }
+        run(mode == "futex", oversubscription, collections);
+        return 0;
+    }
+    std::string self = std::string("\"") + argv[0] + "\"";
+    for (int over = 1; over <= 4; over *= 2) {
+        for (const char* mode : { "yield", "futex" }) {
+            std::string cmd = self + " " + mode + " " + std::to_string(over) + " " + std::to_string(collections);
+            if (std::system(cmd.c_str()) != 0) return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+// hash_stress : the three collectable hash tables against std::unordered_map, through growing, shrinking and
+// collections in the middle of a resize.
+//
+// usage: hash_stress [ops]
+// Every op picks a key and does the same insert, erase, lookup or insert_or_assign on a CollectableHashTable, two
+// CollectableKeyHashTables (one with a plain int value, whose arrays come from calloc, and one with a std::string
+// value, whose entries are constructed) and a CollectableValueHashTable, and checks what they return against the
+// map.  The keys come from a big range and a small one in turn, so the tables fill up, resize larger and then fill
+// with erased slots and resize at the same size.  The tables start small and collections run every so often on
+// this thread, so there are collections while old arrays are still being moved from.  Each table's size has to
+// match the map's after every op.
+// A mismatch prints what went wrong and aborts.  The program returns 0 if every op matched.
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unordered_map>
+
+#include "../DemoWorkload.h"
+
+const int BIG_KEYS = 60000;
+const int SMALL_KEYS = 2000;
+const int PHASE = 300000;
+const int COLLECT_EVERY = 50000;
+
+static int64_t N;
+
+static void fail(const char* table, const char* what, int key)
+{
+    std::cerr << "hash_stress: " << table << " " << what << " wrong for key " << key << " at op " << N << "\n";
+    std::abort();
+}
+
+int main(int argc, char** argv)
+{
+    int64_t ops = argc > 1 ? atoll(argv[1]) : 1500000;
+    if (ops <= 0) {
+        std::cerr << "usage: " << argv[0] << " [ops]\n";
+        return 1;
+    }
+    GC::init(true);
+    {
+        RootPtr<CollectableHashTable<CollectableString, RandomCounted> > swiss = cnew2template(CollectableHashTable<CollectableString, RandomCounted>(16));
+        RootPtr<CollectableKeyHashTable<CollectableString, int> > keys = cnew2template(CollectableKeyHashTable<CollectableString, int>(16));
+        RootPtr<CollectableKeyHashTable<CollectableString, std::string> > named = cnew2template(CollectableKeyHashTable<CollectableString, std::string>(16));
+        RootPtr<CollectableValueHashTable<int, RandomCounted> > values = cnew2template(CollectableValueHashTable<int, RandomCounted>(16));
+        std::unordered_map<int, int> reference;
+        std::default_random_engine generator;
+        for (N = 0; N < ops; ++N) {
+            int range = (N / PHASE) % 2 ? SMALL_KEYS : BIG_KEYS;
+            int k = std::uniform_int_distribution<int>(0, range - 1)(generator);
+            int op = generator() % 7;
+            RootPtr<CollectableString> key = int_to_string(k);
+            if (op < 3) {
+                bool fresh = reference.count(k) == 0;
+                if (fresh) reference[k] = k;
+                if (swiss->insert(key, cnew(RandomCounted(k))) != fresh) fail("CollectableHashTable", "insert", k);
+                if (keys->insert(key, k) != fresh) fail("CollectableKeyHashTable", "insert", k);
+                if (named->insert(key, std::to_string(k)) != fresh) fail("CollectableKeyHashTable<std::string>", "insert", k);
+                if (values->insert(k, cnew(RandomCounted(k))) != fresh) fail("CollectableValueHashTable", "insert", k);
+            }
+            else if (op < 5) {
+                bool there = reference.erase(k) != 0;
+                if (swiss->erase(key) != there) fail("CollectableHashTable", "erase", k);
+                if (keys->erase(key) != there) fail("CollectableKeyHashTable", "erase", k);
+                if (named->erase(key) != there) fail("CollectableKeyHashTable<std::string>", "erase", k);
+                if (values->erase(k) != there) fail("CollectableValueHashTable", "erase", k);
+            }
+            else if (op == 5) {
+                bool there = reference.count(k) != 0;
+                RootPtr<RandomCounted> v = swiss[key];
+                if ((v.get() != nullptr) != there || (there && v->identity != k)) fail("CollectableHashTable", "lookup", k);
+                if (keys->contains(key) != there || (there && (*keys)[key] != k)) fail("CollectableKeyHashTable", "lookup", k);
+                if (named->contains(key) != there || (there && (*named)[key] != std::to_string(k))) fail("CollectableKeyHashTable<std::string>", "lookup", k);
+                RootPtr<RandomCounted> w = (*values)[k];
+                if ((w.get() != nullptr) != there || (there && w->identity != k)) fail("CollectableValueHashTable", "lookup", k);
+            }
+            else {
+                reference[k] = k;
+                swiss->insert_or_assign(key, cnew(RandomCounted(k)));
+                keys->insert_or_assign(key, k);
+                named->insert_or_assign(key, std::to_string(k));
+                values->insert_or_assign(k, cnew(RandomCounted(k)));
+            }
+            int size = (int)reference.size();
+            if (swiss->size() != size) fail("CollectableHashTable", "size", k);
+            if (keys->size() != size) fail("CollectableKeyHashTable", "size", k);
+            if (named->size() != size) fail("CollectableKeyHashTable<std::string>", "size", k);
+            if (values->size() != size) fail("CollectableValueHashTable", "size", k);
+            if (N % COLLECT_EVERY == 0) GC::one_collect();
+        }
+        std::cout << "passed: " << ops << " ops, " << reference.size() << " keys at the end, arrays of " << swiss->HASH_SIZE
+            << ", " << keys->HASH_SIZE << ", " << named->HASH_SIZE << " and " << values->HASH_SIZE << " slots\n";
+    }
+    GC::exit_collect_thread();
+    return 0;
+}
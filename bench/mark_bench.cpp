@@ -0,0 +1,61 @@
+// mark_bench : collection cycle time on a big live heap with slab mark maps versus mark bytes in headers in front of
+// the objects.
+//
+// usage: mark_bench [side|header] [objects] [cycles]
+// Builds a random graph of RandomCounted nodes that are all reachable, then times whole collections.
+// With no mode given the program runs itself once for each mode, since the mode is fixed once allocation starts.
+// Run it under "perf stat -e cache-misses,cache-references" to see the difference in cache misses.
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+
+#include "../DemoWorkload.h"
+
+static void run(bool side, int objects, int cycles)
+{
+    //with no arena every object comes from the system allocator with its mark in an OutsideHeader
+    if (!side) GC::SlabArenaBytes = 0;
+    GC::init(true);
+    {
+        RootPtr<CollectableVector<RandomCounted> > nodes = cnew(CollectableVector<RandomCounted>(objects));
+        std::default_random_engine generator;
+        std::uniform_int_distribution<int> distribution(0, objects - 1);
+        for (int i = 0; i < objects; ++i) nodes->push_back(cnew(RandomCounted(i)));
+        for (int i = 0; i < objects; ++i) {
+            nodes[i]->first = nodes[distribution(generator)];
+            nodes[i]->second = nodes[distribution(generator)];
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < cycles; ++i) GC::one_collect();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << (side ? "side mark map" : "header mark byte") << ": " << objects << " objects, "
+            << elapsed.count() / cycles << " ms per collection\n";
+    }
+    GC::exit_collect_thread();
+}
+
+int main(int argc, char** argv)
+{
+    int objects = 10000000;
+    int cycles = 5;
+    if (argc > 2) objects = atoi(argv[2]);
+    if (argc > 3) cycles = atoi(argv[3]);
+    if (argc > 1) {
+        std::string mode = argv[1];
+        if (mode != "side" && mode != "header") {
+            std::cerr << "usage: " << argv[0] << " [side|header] [objects] [cycles]\n";
+            return 1;
+        }
+        run(mode == "side", objects, cycles);
+        return 0;
+    }
+    std::string self = std::string("\"") + argv[0] + "\"";
+    std::string args = " " + std::to_string(objects) + " " + std::to_string(cycles);
+    int r = std::system((self + " header" + args).c_str());
+    if (r == 0) r = std::system((self + " side" + args).c_str());
+    return r == 0 ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+// refcount_bench : the same shared graph workload with collected pointers, std::shared_ptr and an intrusive atomic
+// reference count, for ops/s, operation latency and memory at 1 to 64 threads.
+//
+// usage: refcount_bench [gc|shared_ptr|intrusive] [threads] [seconds]
+// Every thread works on one graph of NODES slots that all of them share.  Each op is a walk of 4 links from a random
+// slot (6 in 10), a relink of a random node to another (3 in 10) or a new node put in a random slot (1 in 10).
+// Links only ever point at an older node, so the graph never has a cycle and reference counting can free
+// everything the collector would.
+//   gc          InstancePtr slots and links.  A mutator holds plain pointers between safe points, so walking
+//               costs nothing but loads.
+//   shared_ptr  shared_ptr slots and links read and written with std::atomic_load and std::atomic_store, which
+//               is what std::atomic<std::shared_ptr> does in C++20.
+//   intrusive   a count in the node bumped with a locked add.  Taking a reference out of a shared slot has to
+//               hold a lock for the slot while it bumps the count, or the node could be freed between the load
+//               and the add, so slots are guarded by a striped spinlock the way the library guards atomic
+//               shared_ptrs.
+// One op in 16 is timed for the latency percentiles.  Memory is the peak RSS of the process.
+// With no mode given the program runs itself for each mode at 1, 2, 4... 64 threads.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <memory>
+
+#include "../DemoWorkload.h"
+#include "bench_util.h"
+
+const int NODES = 65536;
+const int WALK = 4;
+const int TIMED_EVERY = 16;
+
+//what the walks read, kept so they aren't optimized away
+static std::atomic<int64_t> Found;
+static std::mutex LatencyLock;
+static GC::LatencyHistogram Latency;
+
+struct GcNode : public Collectable
+{
+    InstancePtr<GcNode> first;
+    InstancePtr<GcNode> second;
+    int64_t serial;
+    GcNode(int64_t s) :serial(s) {}
+    GC_TRACE_FIELDS(first, second)
+    size_t my_size() const { return sizeof(*this); }
+};
+
+GC_NO_DESTRUCTOR(GcNode)
+
+struct GcGraph
+{
+    typedef GcNode* Ref;
+    typedef GC::ThreadRAII Thread;
+    CollectableVector<GcNode>* slots;
+
+    static void safe_point() { GC::safe_point(); }
+    Ref slot(int i) { return (*slots)[i].get(); }
+    void set_slot(int i, const Ref& n) { (*slots)[i] = n; }
+    static Ref first(const Ref& n) { return n->first.get(); }
+    static Ref second(const Ref& n) { return n->second.get(); }
+    static void set_first(const Ref& n, const Ref& to) { n->first = to; }
+    static void set_second(const Ref& n, const Ref& to) { n->second = to; }
+    static Ref make(int64_t serial) { return cnew(GcNode(serial)); }
+    static int64_t serial(const Ref& n) { return n->serial; }
+};
+
+struct SharedNode
+{
+    std::shared_ptr<SharedNode> first;
+    std::shared_ptr<SharedNode> second;
+    int64_t serial;
+    SharedNode(int64_t s) :serial(s) {}
+};
+
+//the refcounted graphs have no threads to register, this stands in for GC::ThreadRAII
+struct NoThread
+{
+    NoThread() {}
+};
+
+struct SharedGraph
+{
+    typedef std::shared_ptr<SharedNode> Ref;
+    typedef NoThread Thread;
+    std::vector<Ref> slots;
+
+    static void safe_point() {}
+    Ref slot(int i) { return std::atomic_load(&slots[i]); }
+    void set_slot(int i, const Ref& n) { std::atomic_store(&slots[i], n); }
+    static Ref first(const Ref& n) { return std::atomic_load(&n->first); }
+    static Ref second(const Ref& n) { return std::atomic_load(&n->second); }
+    static void set_first(const Ref& n, const Ref& to) { std::atomic_store(&n->first, to); }
+    static void set_second(const Ref& n, const Ref& to) { std::atomic_store(&n->second, to); }
+    static Ref make(int64_t serial) { return std::make_shared<SharedNode>(serial); }
+    static int64_t serial(const Ref& n) { return n->serial; }
+};
+
+struct IntrusiveNode;
+static void release(IntrusiveNode* n);
+
+//a counted reference held by one thread
+struct IntrusiveRef
+{
+    IntrusiveNode* p;
+    IntrusiveRef() :p(nullptr) {}
+    //takes over a count that has already been added
+    explicit IntrusiveRef(IntrusiveNode* n) :p(n) {}
+    IntrusiveRef(const IntrusiveRef& o);
+    IntrusiveRef(IntrusiveRef&& o) :p(o.p) { o.p = nullptr; }
+    ~IntrusiveRef() { release(p); }
+    IntrusiveRef& operator=(IntrusiveRef o) { std::swap(p, o.p); return *this; }
+    IntrusiveNode* operator->() const { return p; }
+    explicit operator bool() const { return p != nullptr; }
+};
+
+//a reference in a slot or a node that any thread can read or replace
+struct SharedRef
+{
+    std::atomic<IntrusiveNode*> p;
+    SharedRef() :p(nullptr) {}
+    IntrusiveRef load();
+    void store(const IntrusiveRef& n);
+};
+
+struct IntrusiveNode
+{
+    std::atomic_int refs;
+    SharedRef first;
+    SharedRef second;
+    int64_t serial;
+    IntrusiveNode(int64_t s) :refs(1), serial(s) {}
+};
+
+static void retain(IntrusiveNode* n)
+{
+    if (n != nullptr) n->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+//a node that dies takes its links with it.  Nothing else can reach it by then, so they're read without the lock.
+static void release(IntrusiveNode* n)
+{
+    if (n == nullptr || n->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    release(n->first.p.load(std::memory_order_relaxed));
+    release(n->second.p.load(std::memory_order_relaxed));
+    delete n;
+}
+
+IntrusiveRef::IntrusiveRef(const IntrusiveRef& o) :p(o.p) { retain(p); }
+
+const int SLOT_LOCKS = 64;
+static std::atomic_flag SlotLocks[SLOT_LOCKS];
+
+static std::atomic_flag& slot_lock(const SharedRef* r)
+{
+    return SlotLocks[((uintptr_t)r >> 4) % SLOT_LOCKS];
+}
+
+IntrusiveRef SharedRef::load()
+{
+    std::atomic_flag& lock = slot_lock(this);
+    while (lock.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+    IntrusiveNode* n = p.load(std::memory_order_relaxed);
+    retain(n);
+    lock.clear(std::memory_order_release);
+    return IntrusiveRef(n);
+}
+
+void SharedRef::store(const IntrusiveRef& n)
+{
+    retain(n.p);
+    std::atomic_flag& lock = slot_lock(this);
+    while (lock.test_and_set(std::memory_order_acquire)) std::this_thread::yield();
+    IntrusiveNode* old = p.exchange(n.p, std::memory_order_relaxed);
+    lock.clear(std::memory_order_release);
+    release(old);
+}
+
+struct IntrusiveGraph
+{
+    typedef IntrusiveRef Ref;
+    typedef NoThread Thread;
+    std::vector<SharedRef> slots;
+
+    IntrusiveGraph() :slots(NODES) {}
+    static void safe_point() {}
+    Ref slot(int i) { return slots[i].load(); }
+    void set_slot(int i, const Ref& n) { slots[i].store(n); }
+    static Ref first(const Ref& n) { return n->first.load(); }
+    static Ref second(const Ref& n) { return n->second.load(); }
+    static void set_first(const Ref& n, const Ref& to) { n->first.store(to); }
+    static void set_second(const Ref& n, const Ref& to) { n->second.store(to); }
+    static Ref make(int64_t serial) { return IntrusiveRef(new IntrusiveNode(serial)); }
+    static int64_t serial(const Ref& n) { return n->serial; }
+};
+
+template<typename G>
+static void link(const typename G::Ref& n, const typename G::Ref& to, bool second)
+{
+    if (!n || !to || G::serial(to) >= G::serial(n)) return;
+    if (second) G::set_second(n, to);
+    else G::set_first(n, to);
+}
+
+template<typename G>
+static void build(G& g)
+{
+    for (int i = 0; i < NODES; ++i) {
+        G::safe_point();
+        g.set_slot(i, G::make(i));
+    }
+    std::default_random_engine generator;
+    std::uniform_int_distribution<int> distribution(0, NODES - 1);
+    for (int i = 0; i < NODES; ++i) {
+        G::safe_point();
+        typename G::Ref n = g.slot(i);
+        link<G>(n, g.slot(distribution(generator)), false);
+        link<G>(n, g.slot(distribution(generator)), true);
+    }
+}
+
+template<typename G>
+static void mutator(G* g, int tid)
+{
+    typename G::Thread gc_thread;
+    std::default_random_engine generator(tid);
+    std::uniform_int_distribution<int> distribution(0, NODES - 1);
+    //every thread's serials are bigger than the first nodes' and no two threads make the same one
+    int64_t next_serial = NODES;
+    int64_t n = 0;
+    int64_t found = 0;
+    GC::LatencyHistogram* latency = new GC::LatencyHistogram;
+    latency->clear();
+    ++Started;
+    while (!Go) {
+        G::safe_point();
+        std::this_thread::yield();
+    }
+    while (!Stop) {
+        G::safe_point();
+        bool timed = n % TIMED_EVERY == 0;
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        int kind = (int)(n % 10);
+        int i = distribution(generator);
+        int j = distribution(generator);
+        if (kind < 6) {
+            typename G::Ref p = g->slot(i);
+            for (int k = 0; k < WALK && p; ++k) {
+                found += G::serial(p);
+                p = (k ^ j) & 1 ? G::second(p) : G::first(p);
+            }
+        }
+        else if (kind < 9) link<G>(g->slot(i), g->slot(j), kind == 8);
+        else {
+            typename G::Ref fresh = G::make((++next_serial << 7) | tid);
+            link<G>(fresh, g->slot(j), false);
+            g->set_slot(i, fresh);
+        }
+        if (timed) {
+            int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            ++latency->counts[GC::LatencyHistogram::bucket(ns)];
+            ++latency->total;
+            if (ns > latency->highest) latency->highest = ns;
+        }
+        ++n;
+    }
+    Ops += n;
+    std::lock_guard<std::mutex> lock(LatencyLock);
+    Latency.add(*latency);
+    delete latency;
+    Found += found;
+}
+
+template<typename G>
+static void measure(const char* mode, G* g, int threads, double seconds)
+{
+    Latency.clear();
+    std::vector<std::thread> mutators;
+    for (int i = 0; i < threads; ++i) mutators.emplace_back(mutator<G>, g, i);
+    while (Started < threads) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto start = std::chrono::steady_clock::now();
+    Go = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    Stop = true;
+    for (auto& t : mutators) t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << std::fixed << std::setprecision(1) << mode << ", " << threads << (threads == 1 ? " thread: " : " threads: ")
+        << Ops / elapsed.count() << " ops/s, latency p50 " << Latency.percentile(0.5) << " ns, p99 "
+        << Latency.percentile(0.99) << " ns, max " << Latency.highest / 1000.0 << " us, peak RSS " << peak_rss_mb() << " MB\n";
+}
+
+static void run(const std::string& mode, int threads, double seconds)
+{
+    if (mode == "gc") {
+        GC::init();
+        GC::init_thread();
+        {
+            RootPtr<CollectableVector<GcNode> > slots = cnew(CollectableVector<GcNode>(NODES));
+            for (int i = 0; i < NODES; ++i) slots->push_back(nullptr);
+            GcGraph g;
+            g.slots = slots.get();
+            build(g);
+            //this thread holds the graph but doesn't touch it while the mutators run
+            GC::LeaveMutationRAII away;
+            measure("gc", &g, threads, seconds);
+        }
+        GC::exit_thread();
+        GC::exit_collect_thread();
+    }
+    else if (mode == "shared_ptr") {
+        SharedGraph g;
+        g.slots.resize(NODES);
+        build(g);
+        measure("shared_ptr", &g, threads, seconds);
+    }
+    else {
+        IntrusiveGraph g;
+        build(g);
+        measure("intrusive", &g, threads, seconds);
+        for (int i = 0; i < NODES; ++i) g.slots[i].store(IntrusiveRef());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+    double seconds = argc > 3 ? atof(argv[3]) : 1;
+    if (argc > 1) {
+        std::string mode = argv[1];
+        if ((mode != "gc" && mode != "shared_ptr" && mode != "intrusive") || threads < 0 || threads > 64 || seconds <= 0) {
+            std::cerr << "usage: " << argv[0] << " [gc|shared_ptr|intrusive] [threads] [seconds]\n";
+            return 1;
+        }
+        if (threads > 0) {
+            run(mode, threads, seconds);
+            return 0;
+        }
+    }
+    std::vector<std::string> modes;
+    for (const char* mode : { "gc", "shared_ptr", "intrusive" }) if (argc == 1 || argv[1] == std::string(mode)) modes.push_back(mode);
+    if (!run_each_in_own_process(argv[0], modes, 64, seconds)) return 1;
+    return 0;
+}
@@ -0,0 +1,79 @@
+// snapptr_bench : cost of each SnapPtr primitive, to compare builds against each other (MSVC intrinsics versus
+// the GCC/Clang versions in SnapPtr.h).
+//
+// usage: snapptr_bench [iterations]
+// Each primitive runs over a small array of pointers that stays in L1, so this is the cost of the instructions
+// themselves on one thread, without contention.
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "../SnapPtr.h"
+
+using namespace GC;
+
+const int SLOTS = 1024;
+static SnapPtr Slots[SLOTS];
+static char Targets[SLOTS];
+//read after every run so the compiler can't drop the work
+static volatile uint64_t Sink;
+
+template<typename F>
+static void time_primitive(const char* name, int iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < iterations; ++n) {
+        for (int i = 0; i < SLOTS; ++i) f(&Slots[i], &Targets[(i + n) & (SLOTS - 1)]);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t sum = 0;
+    for (int i = 0; i < SLOTS; ++i) sum += snap_live(Slots[i]) ^ snap_snapshot(Slots[i]);
+    Sink = sum;
+    std::cout << name << ": " << elapsed.count() / ((double)iterations * SLOTS) << " ns\n";
+}
+
+//leaves every slot dirty, live pointing at target and snapshot at the slot itself
+static void dirty_all(char* target)
+{
+    for (int i = 0; i < SLOTS; ++i) {
+        double_ptr_store(&Slots[i], &Slots[i]);
+        single_ptr_store(&Slots[i], target + i);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 20000;
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations < 1) {
+        std::cerr << "usage: " << argv[0] << " [iterations]\n";
+        return 1;
+    }
+
+    time_primitive("double_ptr_store", iterations, [](SnapPtr* s, char* t) { double_ptr_store(s, t); });
+    time_primitive("single_ptr_store", iterations, [](SnapPtr* s, char* t) { single_ptr_store(s, t); });
+    time_primitive("double_ptr_load", iterations, [](SnapPtr* s, char*) { Sink = snap_snapshot(double_ptr_load(s)); });
+    time_primitive("double_ptr_CAS", iterations, [](SnapPtr* s, char* t) {
+        SnapPtr expected = double_ptr_load(s);
+        SnapPtr to;
+        snap_live(to) = snap_snapshot(to) = (uint64_t)t;
+        double_ptr_CAS(s, &expected, to);
+    });
+    //a clean pointer is the common case for both restores, dirty ones are timed separately
+    time_primitive("fast_restore clean", iterations, [](SnapPtr* s, char*) { fast_restore(s); });
+    time_primitive("restore clean", iterations, [](SnapPtr* s, char*) { restore(s); });
+    time_primitive("fast_restore dirty", iterations, [](SnapPtr* s, char* t) { single_ptr_store(s, t + 1); fast_restore(s); });
+    time_primitive("restore dirty", iterations, [](SnapPtr* s, char* t) { single_ptr_store(s, t + 1); restore(s); });
+    time_primitive("single_ptr_store alone, for the dirty rows", iterations, [](SnapPtr* s, char* t) { single_ptr_store(s, t + 1); });
+
+    dirty_all(Targets);
+    for (int i = 0; i < SLOTS; ++i) restore(&Slots[i]);
+    for (int i = 0; i < SLOTS; ++i) {
+        if (snap_live(Slots[i]) != (uint64_t)(Targets + i) || snap_snapshot(Slots[i]) != (uint64_t)(Targets + i)) {
+            std::cerr << "restore left slot " << i << " wrong\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+// trace_bench : marking time on a big random graph, with and without the mark prefetch FIFO.
+//
+// usage: trace_bench [prefetch|noprefetch] [objects] [cycles]
+// Builds the kind of graph mutator_thread builds in bunch, RandomCounted nodes each pointing at two random others,
+// held by a vector so that they're all reachable.  The nodes are allocated in a shuffled order, so following the
+// links jumps all over the heap the way it does in a long running program.  Everything stays live, so a collection
+// is almost all marking.
+// With no mode given the program runs itself once for each mode.
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "../DemoWorkload.h"
+
+static void run(bool prefetch, int objects, int cycles)
+{
+    GC::MarkPrefetch = prefetch;
+    GC::init(true);
+    {
+        std::default_random_engine generator;
+        std::vector<int> order(objects);
+        for (int i = 0; i < objects; ++i) order[i] = i;
+        std::shuffle(order.begin(), order.end(), generator);
+
+        RootPtr<CollectableVector<RandomCounted> > nodes = cnew(CollectableVector<RandomCounted>(objects));
+        {
+            RootPtr<CollectableVector<RandomCounted> > allocated = cnew(CollectableVector<RandomCounted>(objects));
+            for (int i = 0; i < objects; ++i) allocated->push_back(cnew(RandomCounted(i)));
+            for (int i = 0; i < objects; ++i) nodes->push_back(allocated[order[i]]);
+        }
+        std::uniform_int_distribution<int> distribution(0, objects - 1);
+        for (int i = 0; i < objects; ++i) {
+            nodes[i]->first = nodes[distribution(generator)];
+            nodes[i]->second = nodes[distribution(generator)];
+        }
+
+        GC::one_collect();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < cycles; ++i) GC::one_collect();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cerr << (prefetch ? "prefetch FIFO" : "no prefetch") << ": " << objects << " objects, "
+            << elapsed.count() / cycles << " ms per collection\n";
+    }
+    GC::exit_collect_thread();
+}
+
+int main(int argc, char** argv)
+{
+    int objects = 4000000;
+    int cycles = 5;
+    if (argc > 2) objects = atoi(argv[2]);
+    if (argc > 3) cycles = atoi(argv[3]);
+    if (argc > 1) {
+        std::string mode = argv[1];
+        if ((mode != "prefetch" && mode != "noprefetch") || objects < 1 || cycles < 1) {
+            std::cerr << "usage: " << argv[0] << " [prefetch|noprefetch] [objects] [cycles]\n";
+            return 1;
+        }
+        run(mode == "prefetch", objects, cycles);
+        return 0;
+    }
+    std::string self = std::string("\"") + argv[0] + "\"";
+    std::string args = " " + std::to_string(objects) + " " + std::to_string(cycles);
+    int r = std::system((self + " noprefetch" + args).c_str());
+    if (r == 0) r = std::system((self + " prefetch" + args).c_str());
+    return r == 0 ? 0 : 1;
+}
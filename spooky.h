@@ -35,6 +35,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <string>
 
 #define SC_NUMVARS		12